@@ -0,0 +1,129 @@
+/*
+ * Build-time configuration: image geometry, limits and optional subsystems.
+ *
+ * A profile is picked with -DCONFIG_PROFILE_EMBEDDED or
+ * -DCONFIG_PROFILE_SERVER, see the makefile targets; without one the
+ * defaults below apply. Any single value can still be overridden with
+ * -D, every one of them is guarded. All of them are compile-time
+ * constants, so loops over groups, words and inodes get constant bounds.
+ */
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#if defined(CONFIG_PROFILE_EMBEDDED)
+// Small devices: the default geometry, short paths, few threads, small buffers
+#define CONFIG_PROFILE "embedded"
+#ifndef PATH_MAXLEN
+#define PATH_MAXLEN 1024
+#endif
+#ifndef PATH_MAXDEPTH
+#define PATH_MAXDEPTH 32
+#endif
+#ifndef POOL_MAXTHREADS
+#define POOL_MAXTHREADS 4
+#endif
+#ifndef FIND_BUFLEN
+#define FIND_BUFLEN 4096
+#endif
+#ifndef DD_BATCH
+#define DD_BATCH 256
+#endif
+#ifndef BTREE_ORDER
+#define BTREE_ORDER 16
+#endif
+#ifndef BENCH_INODES
+#define BENCH_INODES (1 << 16)
+#endif
+#ifndef CONFIG_CRC_HW
+#define CONFIG_CRC_HW 0
+#endif
+#elif defined(CONFIG_PROFILE_SERVER)
+// Large images: 64k inodes and 256k blocks, wide index nodes, large batches
+#define CONFIG_PROFILE "server"
+#ifndef GROUP_COUNT
+#define GROUP_COUNT 64
+#endif
+#ifndef GROUP_INODES
+#define GROUP_INODES 1024
+#endif
+#ifndef GROUP_BLOCKS
+#define GROUP_BLOCKS 4096
+#endif
+#ifndef FIND_BUFLEN
+#define FIND_BUFLEN 262144
+#endif
+#ifndef DD_BATCH
+#define DD_BATCH 16384
+#endif
+#ifndef BTREE_ORDER
+#define BTREE_ORDER 64
+#endif
+#else
+#define CONFIG_PROFILE "default"
+#endif
+
+// Geometry
+#ifndef GROUP_COUNT
+#define GROUP_COUNT 4      // number of allocation groups
+#endif
+#ifndef GROUP_INODES
+#define GROUP_INODES 4     // inodes per allocation group
+#endif
+#ifndef GROUP_BLOCKS
+#define GROUP_BLOCKS 32    // data blocks per allocation group
+#endif
+#ifndef BLOCK_PTRS
+#define BLOCK_PTRS 8       // direct block pointers per inode, the largest file size in blocks
+#endif
+
+// Limits
+#ifndef FILENAME_MAXLEN
+#define FILENAME_MAXLEN 256 // including the NULL char
+#endif
+#ifndef PATH_MAXLEN
+#define PATH_MAXLEN 4096   // including the NULL char
+#endif
+#ifndef PATH_MAXDEPTH
+#define PATH_MAXDEPTH 128  // maximum number of components in a path
+#endif
+#ifndef POOL_MAXTHREADS
+#define POOL_MAXTHREADS 64 // workers of a traversal pool
+#endif
+#ifndef FIND_BUFLEN
+#define FIND_BUFLEN 65536  // bytes of FIND output buffered per worker
+#endif
+#ifndef DD_BATCH
+#define DD_BATCH 4096      // inodes and blocks a DD worker frees at once
+#endif
+#ifndef BTREE_ORDER
+#define BTREE_ORDER 32     // entries or separators per node of a directory's B+tree
+#endif
+#ifndef BENCH_INODES
+#define BENCH_INODES (1 << 21) // inode table size used by bench_inodes()
+#endif
+#ifndef BENCH_ROUNDS
+#define BENCH_ROUNDS 20    // repetitions of each benchmarked scan
+#endif
+
+// Optional subsystems
+#ifndef CONFIG_CRC_HW
+#define CONFIG_CRC_HW 1    // 1 to pick the SSE4.2 CRC32C kernel on CPUs that have it
+#endif
+#ifndef CONFIG_CHECKS
+#define CONFIG_CHECKS 0    // 1 to check the usage counters against the bitmaps after every command
+#endif
+#ifndef CONFIG_PROBES
+#define CONFIG_PROBES 1    // 1 for USDT probes on the hot paths, where <sys/sdt.h> is available
+#endif
+
+#if FILENAME_MAXLEN > 256
+#error "entry name lengths are stored in a byte"
+#endif
+#if BLOCK_PTRS != 8
+#error "the image format stores 8 block pointers per inode"
+#endif
+#if BTREE_ORDER < 3
+#error "B+tree nodes must hold at least 3 entries"
+#endif
+
+#endif
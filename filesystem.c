@@ -1,6 +1,58 @@
+#define _GNU_SOURCE // nftw()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdarg.h>
+#include <fnmatch.h>
+#include <sched.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "config.h"
+#if CONFIG_CRC_HW && defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+#if CONFIG_PROBES && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1 // Every probe gets a counter that tracers raise while attached.
+#include <sys/sdt.h>
+#define PROBE_SEMAPHORE(name) unsigned short filesystem_##name##_semaphore __attribute__((unused, section(".probes")))
+#define PROBE_ENABLED(name) __builtin_expect(filesystem_##name##_semaphore != 0, 0) // 1 while a tracer is attached.
+#define PROBE(name, ...) do { if (PROBE_ENABLED(name)) STAP_PROBEV(filesystem, name, __VA_ARGS__); } while (0) // USDT probe.
+#endif
+#endif
+#ifndef PROBE
+#define PROBE_SEMAPHORE(name) extern int probe_semaphores
+#define PROBE_ENABLED(name) 0
+#define PROBE(name, ...) do { if (0) probe_none(0, __VA_ARGS__); } while (0) // Compiled out, arguments unused.
+void probe_none(int unused, ...)
+{
+    (void)unused;
+}
+#endif
+#define PROBE_CLOCK(name) (PROBE_ENABLED(name) ? now_ns() : 0LL) // Start of a duration name reports, read only while traced.
+#define PROBE_SINCE(begin) ((begin) != 0 ? now_ns() - (begin) : 0LL) // The duration, 0 if the tracer attached after its start.
+
+// Probe semaphores, one per probe of the "filesystem" provider
+PROBE_SEMAPHORE(command_entry);
+PROBE_SEMAPHORE(command_return);
+PROBE_SEMAPHORE(walk_step);
+PROBE_SEMAPHORE(lookup);
+PROBE_SEMAPHORE(inode_alloc);
+PROBE_SEMAPHORE(inode_free);
+PROBE_SEMAPHORE(block_alloc);
+PROBE_SEMAPHORE(block_free);
+PROBE_SEMAPHORE(block_run);
+PROBE_SEMAPHORE(dir_add);
+PROBE_SEMAPHORE(dir_remove);
+PROBE_SEMAPHORE(batch_free);
+PROBE_SEMAPHORE(sync_begin);
+PROBE_SEMAPHORE(sync_end);
 
 /*
  *   ___ ___ ___ ___ ___ ___ ___ ___ ___ ___ ___
@@ -39,1009 +91,5689 @@
  *
  */
 
-#define FILENAME_MAXLEN 8 // including the NULL char
+#define GROUP_WORDS ((GROUP_BLOCKS + 63) / 64) // bitmap words per allocation group
+#define INODE_COUNT (GROUP_COUNT * GROUP_INODES)
+#define BLOCK_COUNT (GROUP_COUNT * GROUP_BLOCKS)
+#define INODE_WORDS ((INODE_COUNT + 63) / 64) // words of a one bit per inode array
+#define TRACE_MAGIC "FSTR" // first bytes of a trace file
+#define TRACE_VERSION 2    // trace format version
+#define TRACE_SCRIPT 1     // trace header flag: a compiled script, with no recorded results or timing
+#define TRACE_MAXREPORT 10 // divergences printed by a replay
+#define INLINE_MAXLEN 32   // bytes of an inode that can hold inline contents
+#define INODE_INLINE 1     // inode flag: contents live in the inode, not in blocks
+#define INODE_DELAYED 2    // inode flag: some blocks are reserved but not yet assigned
+#define BLOCK_HOLE -1      // block pointer of a sparse file's unallocated block
+#define BLOCK_DELAYED -2   // block pointer of a reserved block, assigned at the next flush
+#define BLOCK_SIZE 1024    // bytes a data block stands for in host files, for IMPORT and EXPORT
+#define TAR_BLOCK 512      // record size of a tar archive
+#define FSCK_MAXREPORT 20  // problems printed by FSCK, the rest are only counted
 
-// inode
-typedef struct inode
+// block map of an inode
+typedef union blockmap
 {
-    int dir; // boolean value. 1 if it's a directory.
-    char name[FILENAME_MAXLEN];
-    int size;         // actual file/directory size in bytes.
-    int blockptrs[8]; // direct pointers to blocks containing file's content.
-    int used;         // boolean value. 1 if the entry is in use.
-    int rsvd;         // reserved for future use
-} inode;
+    int blockptrs[BLOCK_PTRS]; // direct pointers to blocks containing file's content.
+    unsigned char inl[INLINE_MAXLEN]; // inline contents, if INODE_INLINE is set.
+} blockmap;
 
-// directory entry
+// directory entry, 12 bytes whatever the length of its name
 typedef struct dirent
 {
-    char name[FILENAME_MAXLEN];
-    int namelen; // length of entry name
-    int inode;   // this entry inode index
+    int nameoff;              // offset of entry name in the directory's name arena
+    int inode;                // this entry inode index
+    unsigned int hash : 24;   // hash of entry name, compared before the name itself
+    unsigned int namelen : 8; // length of entry name, excluding the NULL char
 } dirent;
 
-// Linked List 
-typedef struct node
+// B+tree node of a directory's name index, the start of both a btleaf and a btinner
+typedef struct btnode
+{
+    int leaf;  // 1 if the node is a btleaf, 0 if it is a btinner.
+    int count; // Entries of a leaf, or separators of an inner node.
+} btnode;
+
+// B+tree leaf: entries sorted by name
+typedef struct btleaf
+{
+    btnode hdr;
+    int cap;             // Entries there is room for; only a root leaf has fewer than BTREE_ORDER.
+    struct btleaf *next; // Next leaf in name order.
+    int items[];         // Entries, as positions in the directory's array, sorted by name.
+} btleaf;
+
+// B+tree inner node: separators and subtrees
+typedef struct btinner
+{
+    btnode hdr;
+    char *keys[BTREE_ORDER];       // Copy of the first name below each child but the first.
+    btnode *child[BTREE_ORDER + 1]; // Subtrees, child[i + 1] holding the names from keys[i].
+} btinner;
+
+// command opcodes
+enum
+{
+    OP_NONE = -1,
+    OP_CR,
+    OP_DL,
+    OP_CP,
+    OP_MV,
+    OP_CD,
+    OP_DD,
+    OP_LL,
+    OP_DF,
+    OP_FIND,
+    OP_IMPORT,
+    OP_EXPORT,
+    OP_LS,
+    OP_FSCK,
+    OP_COUNT
+};
+
+char *opnames[OP_COUNT] = {"CR", "DL", "CP", "MV", "CD", "DD", "LL", "DF", "FIND", "IMPORT", "EXPORT", "LS", "FSCK"}; // Command names, by opcode.
+int op_args[OP_COUNT] = {1, 1, 2, 2, 1, 1, 0, 0, 2, 2, 2, 2, 1}; // Path arguments of each command.
+int op_writes[OP_COUNT] = {1, 1, 1, 1, 1, 1, 0, 0, 0, 1, 0, 0, 1}; // 1 if the command changes the image.
+
+// trace record: one executed command
+typedef struct traceRecord
+{
+    unsigned long long delta;   // Nanoseconds since the previous record.
+    unsigned long long latency; // Nanoseconds the command took.
+    int op;     // OP_* opcode.
+    int result; // Result code the command returned.
+    int size;   // Size argument of CR.
+    char *arg1; // First path argument.
+    char *arg2; // Second path argument.
+} traceRecord;
+
+// allocation group: a range of inodes and data blocks with its own bitmap and counters
+typedef struct group
+{
+    int freeInodes; // Unused inodes in the group's range.
+    int freeBlocks; // Unused data blocks in the group's range.
+    unsigned long long bitmap[GROUP_WORDS]; // One bit per data block, 1 if in use.
+    pthread_mutex_t lock; // Serializes allocation within the group.
+} group;
+
+// usage counters, kept current by every allocate and free path so reading them needs no scan
+typedef struct fsstat
+{
+    int freeInodes;     // Unused inodes.
+    int freeBlocks;     // Unused data blocks.
+    int reservedBlocks; // Blocks promised to files but not yet assigned.
+    int sharedRefs;     // Block references that cost no space, from dedup.
+    int files;          // Files in use.
+    int dirs;           // Directories in use.
+    int inlineDirs;     // Directories held inline in their inode.
+} fsstat;
+
+// directory iterator, covering both inline and block directories
+typedef struct diriter
+{
+    int dirInode;      // Directory being iterated.
+    int item;          // Next entry of a block directory.
+    int off;           // Next entry offset of an inline directory.
+    int inode;         // Inode of the current entry.
+    char *name;        // Name of the current entry.
+} diriter;
+
+// traversal task: a directory to visit
+typedef struct walkTask
+{
+    int inode;  // Directory inode.
+    int depth;  // Levels below the start directory.
+    char *path; // Absolute path, owned by the task.
+} walkTask;
+
+// traversal worker: a thread and its deque of tasks
+typedef struct worker
+{
+    walkTask *tasks;      // Deque; the owner works at the tail, thieves take from the head.
+    int head;             // First queued task.
+    int tail;             // One past the last queued task.
+    int cap;              // Tasks allocated.
+    pthread_mutex_t lock; // Guards the deque against thieves.
+    struct pool *pool;    // Pool the worker belongs to.
+    int id;               // Index in the pool.
+    void *local;          // Per worker state of the traversal.
+} worker;
+
+// traversal pool: workers that share a tree by stealing each other's tasks
+typedef struct pool
+{
+    worker workers[POOL_MAXTHREADS];
+    int count;   // Workers running.
+    int pending; // Tasks queued or being visited; the traversal ends at zero.
+    void (*visit)(worker *, walkTask *); // Visits one directory, pushing its subdirectories.
+    void *arg;   // Traversal parameters shared by all workers.
+} pool;
+
+// FIND query: predicates an entry must satisfy
+typedef struct findQuery
+{
+    char *glob;    // Pattern the entry name must match.
+    int type;      // 'f' or 'd' to keep only files or directories, 0 for both.
+    char sizeOp;   // '<', '=' or '>' to compare file sizes, 0 for none.
+    int size;      // Size in blocks compared against.
+    int maxDepth;  // Deepest level reported, the start directory being 0.
+    int matches;   // Entries reported.
+    pthread_mutex_t outLock; // Serializes flushes to stdout.
+} findQuery;
+
+// FIND output buffer of one worker
+typedef struct findOut
+{
+    int len; // Bytes buffered.
+    char data[FIND_BUFLEN];
+} findOut;
+
+// DD release batch of one worker
+typedef struct ddBatch
+{
+    int inodes[DD_BATCH]; // Inodes to free.
+    int blocks[DD_BATCH]; // Blocks to free or unshare.
+    int inodeCount;
+    int blockCount;
+} ddBatch;
+
+// IMPORT scan entry: a host file or directory, in the order nftw() visits them
+typedef struct importEntry
+{
+    char *name;      // Entry name, owned by the entry.
+    int parent;      // Index of the parent entry, -1 for the top one.
+    int dir;         // 1 if it's a directory.
+    int size;        // Size of a file, in blocks.
+    int inlineBytes; // Bytes the entries of a directory take inline.
+} importEntry;
+
+// FSCK repair: an entry to unlink, or a '..' to point at the right parent
+typedef struct fsckFix
+{
+    int dir;    // Directory to change.
+    int inode;  // Entry inode to unlink, or the parent to set.
+    int parent; // 2 to set '.', 1 to set '..', 0 to unlink.
+} fsckFix;
+
+// FSCK state shared by its threads
+typedef struct fsckState
+{
+    int fileRefs[BLOCK_COUNT]; // File block pointers to each block.
+    int dirRefs[BLOCK_COUNT];  // Directories stored in each block.
+    unsigned long long reached[INODE_WORDS]; // Inodes linked from the tree below the root.
+    unsigned long long broken[INODE_WORDS];  // Directories too damaged to walk.
+    int parent[INODE_COUNT]; // Directory each inode was reached from.
+    int problems; // Inconsistencies found.
+    int repair;   // 1 to repair what is found.
+    fsckFix *fixes; // Repairs found while walking, applied afterwards.
+    int fixCount, fixCap;
+    pthread_mutex_t lock; // Guards fixes.
+} fsckState;
+
+// FSCK range of a parallel pass
+typedef struct fsckRange
+{
+    fsckState *st;
+    int lo; // First inode or block of the range.
+    int hi; // One past the last.
+} fsckRange;
+
+// shard of the image, written or loaded on a thread of its own
+typedef struct shardJob
+{
+    int shard;  // Shard to write or load.
+    int result; // 0 on success, -1 on error.
+} shardJob;
+
+// directory: entry array and the arena its names are stored in
+typedef struct directory
+{
+    dirent *ents;  // Entries, in insertion order.
+    int count;     // Entries in use.
+    int cap;       // Entries allocated.
+    char *names;   // Name arena, each name stored once and NULL terminated.
+    int namesLen;  // Bytes of the arena in use.
+    int namesCap;  // Bytes allocated for the arena.
+    int namesDead; // Bytes in use by names of deleted entries.
+    btnode *index; // Entries by name, for lookups and sorted listings.
+    int bytes;     // Heap bytes held by the entries, arena and index.
+    int evicted;   // 1 if the entries were dropped, to be read back from the image.
+    long offset;   // Position of the first entry line in its shard's image.
+    unsigned long long used; // Cache tick of the last access.
+} directory;
+
+// directory cache: entries of cold directories are dropped once over budget, and read back on access
+typedef struct dircache
 {
-    struct dirent data; // Data of type 'dirent'.
-    struct node *next;  // Pointer to the next node.
-} node;
+    long long budget;   // Bytes of entries kept resident, 0 for no limit.
+    long long resident; // Bytes of entries resident.
+    int evictions;      // Directories dropped.
+    int faults;         // Directories read back.
+    unsigned long long tick; // Access clock, for picking the coldest directories.
+    pthread_mutex_t lock;    // Serializes reading directories back.
+} dircache;
+
+dircache cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
 
 /**
- * @brief prints the linked list
+ * @brief returns the name of an entry, stored in the directory's arena
  *
- * @param head
+ * @param dir
+ * @param item
+ * @return char*
  */
-void printList(node *head)
+char *entryname(directory *dir, const dirent *item)
 {
-    node *ptr = head; // Pointer to traverse the linked list.
-    printf("[ ");      // Print start of list indicator.
-    while (ptr != NULL)
-    {
-        printf("%d(%s) ", ptr->data.inode, ptr->data.name); // Print inode and name.
-        ptr = ptr->next; // Move to the next node.
-    }
-    printf("]\n"); // Print end of list indicator and newline.
+    return dir->names + item->nameoff;
 }
 
 /**
- * @brief adds a new element to the end of the linked list
+ * @brief accounts delta bytes of heap to a directory and to the resident size
  *
- * @param headaddr
- * @param inode
- * @param name
+ * @param dir
+ * @param delta
  */
-void push(node **headaddr, int inode, char *name)
+void dir_charge(directory *dir, int delta)
 {
-    node *link = (node *)malloc(sizeof(node)); // Allocate memory for a new node.
-    link->data.inode = inode; // Set the inode value in the node.
-    strcpy(link->data.name, name); // Copy the name to the node.
-    link->data.namelen = strlen(name) + 1; // Calculate and set the length of the name.
-    link->next = NULL; // Initialize next pointer as NULL.
-
-    if (*headaddr == NULL)
-    {
-        *headaddr = link; // If list is empty, make the new node the head.
-    }
-    else
-    {
-        node *ptr = *headaddr; // Create a pointer to traverse the list.
-        while (ptr->next != NULL)
-        {
-            ptr = ptr->next; // Move to the end of the list.
-        }
-        ptr->next = link; // Link the new node to the end of the list.
-    }
+    dir->bytes += delta;
+    __atomic_fetch_add(&cache.resident, delta, __ATOMIC_RELAXED);
 }
 
 /**
- * @brief deletes the element with given inode from the linked list
+ * @brief copies a name into the arena of a directory and returns its offset
  *
- * @param headaddr
- * @param inode
+ * @param dir
+ * @param name
+ * @param len
  * @return int
  */
-int delete(node **headaddr, int inode)
+int intern(directory *dir, const char *name, int len)
 {
-    node *current = *headaddr, *previous = NULL; // Pointers for traversal.
-
-    while (current->data.inode != inode)
+    if (dir->namesLen + len + 1 > dir->namesCap)
     {
-        if (current->next == NULL)
+        int cap = dir->namesCap == 0 ? 64 : dir->namesCap; // Start small, double when full.
+        while (dir->namesLen + len + 1 > cap)
         {
-            printf("Inode %d not in list\n", inode); // Inode not found in list.
-            return -1; // Return error code.
+            cap *= 2;
         }
-        previous = current;
-        current = current->next;
+        dir->names = (char *)realloc(dir->names, cap); // Grow the arena.
+        dir_charge(dir, cap - dir->namesCap);
+        dir->namesCap = cap;
     }
 
-    if (current == *headaddr)
-    {
-        *headaddr = current->next; // If the node to be deleted is the head.
-    }
-    else
+    int off = dir->namesLen;              // Name goes at the end of the arena.
+    memcpy(dir->names + off, name, len);  // Copy the name.
+    dir->names[off + len] = '\0';         // Terminate it.
+    dir->namesLen += len + 1;
+    return off;
+}
+
+/**
+ * @brief rewrites the arena of a directory without the names of deleted entries
+ *
+ * @param dir
+ */
+void compact(directory *dir)
+{
+    char *names = (char *)malloc(dir->namesLen - dir->namesDead); // New, tightly sized arena.
+    int off = 0;
+
+    for (dirent *ptr = dir->ents; ptr < dir->ents + dir->count; ++ptr)
     {
-        previous->next = current->next; // Link the previous node to the next node.
+        memcpy(names + off, dir->names + ptr->nameoff, ptr->namelen + 1); // Move the live name.
+        ptr->nameoff = off;
+        off += ptr->namelen + 1;
     }
 
-    free(current); // Free memory occupied by the node to be deleted.
-    return 0; // Return success code.
+    free(dir->names);
+    dir_charge(dir, off - dir->namesCap);
+    dir->names = names;
+    dir->namesLen = off;
+    dir->namesCap = off;
+    dir->namesDead = 0;
 }
 
+
 /**
- * @brief returns the length of the linked list
+ * @brief prints the entries of a directory
  *
- * @param head
- * @return int
+ * @param dir
  */
-int length(node *head)
+void printList(directory *dir)
 {
-    int length = 0; // Initialize length counter.
-    node *current = head; // Pointer to traverse the list.
-
-    while (current != NULL)
+    printf("[ ");      // Print start of list indicator.
+    for (int k = 0; k < dir->count; ++k)
     {
-        ++length; // Increment length for each node.
-        current = current->next; // Move to the next node.
+        printf("%d(%s) ", dir->ents[k].inode, entryname(dir, &dir->ents[k])); // Print inode and name.
     }
-
-    return length; // Return the total length of the list.
+    printf("]\n"); // Print end of list indicator and newline.
 }
 
 /**
- * @brief returns the element with given name from the linked list
+ * @brief returns the FNV-1a hash of a name, folded to the 24 bits an entry keeps
  *
- * @param head
  * @param name
- * @return node*
+ * @param len
+ * @return unsigned int
  */
-node *find(node *head, char *name)
+unsigned int hash(const char *name, int len)
 {
-    if (head == NULL)
+    unsigned int h = 2166136261u; // FNV offset basis.
+    for (int i = 0; i < len; ++i)
     {
-        return NULL; // If list is empty, return NULL.
+        h ^= (unsigned char)name[i]; // Mix in the next byte.
+        h *= 16777619u;              // FNV prime.
     }
+    return (h ^ (h >> 24)) & 0xffffff;
+}
 
-    node *current = head; // Pointer to traverse the list.
-
-    while (strcmp(name, current->data.name) != 0)
+/**
+ * @brief returns the first position of a leaf whose name is not below name, or above it if after is set
+ *
+ * @param dir
+ * @param leaf
+ * @param name
+ * @param after
+ * @return int
+ */
+int bt_search(directory *dir, btleaf *leaf, const char *name, int after)
+{
+    int lo = 0, hi = leaf->hdr.count;
+    while (lo < hi)
     {
-        if (current->next == NULL)
+        int mid = (lo + hi) / 2, c = strcmp(entryname(dir, &dir->ents[leaf->items[mid]]), name);
+        if (c < 0 || (after && c == 0))
+        {
+            lo = mid + 1;
+        }
+        else
         {
-            return NULL; // If end of list is reached, return NULL (name not found).
+            hi = mid;
         }
-        current = current->next; // Move to the next node.
     }
-
-    return current; // Return pointer to the node with matching name.
+    return lo;
 }
 
 /**
- * @brief returns the element at given index from the linked list
+ * @brief returns the child of an inner node whose range holds name
  *
- * @param head
- * @param index
- * @return node*
+ * @param n
+ * @param name
+ * @return int
  */
-node *get(node *head, int index)
+int bt_child(btinner *n, const char *name)
 {
-    if (head == NULL)
+    int lo = 0, hi = n->hdr.count;
+    while (lo < hi)
     {
-        return NULL; // If list is empty, return NULL.
+        int mid = (lo + hi) / 2;
+        if (strcmp(name, n->keys[mid]) < 0)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
     }
+    return lo;
+}
 
-    node *current = head; // Pointer to traverse the list.
-
-    for (int i = 0; i < index; ++i)
+/**
+ * @brief returns the leaf whose range holds name
+ *
+ * @param dir
+ * @param name
+ * @return btleaf*
+ */
+btleaf *bt_leaf(directory *dir, const char *name)
+{
+    btnode *n = dir->index;
+    while (n != NULL && !n->leaf)
     {
-        if (current->next == NULL)
-        {
-            return NULL; // If end of list is reached, return NULL (index out of bounds).
-        }
-        current = current->next; // Move to the next node.
+        n = ((btinner *)n)->child[bt_child((btinner *)n, name)];
     }
+    return (btleaf *)n;
+}
 
-    return current; // Return pointer to the node at the specified index.
+/**
+ * @brief allocates an empty leaf with room for cap entries
+ *
+ * @param dir
+ * @param cap
+ * @return btleaf*
+ */
+btleaf *bt_newleaf(directory *dir, int cap)
+{
+    btleaf *leaf = (btleaf *)calloc(1, sizeof(btleaf) + cap * sizeof(int));
+    dir_charge(dir, sizeof(btleaf) + cap * sizeof(int));
+    leaf->hdr.leaf = 1;
+    leaf->cap = cap;
+    return leaf;
 }
 
-node *dataTable[127]; // Array of pointers to nodes.
-inode inodeTable[16]; // Array of inodes.
-int dataBitmap[127];  // Array representing a bitmap for data.
+/**
+ * @brief allocates an empty inner node
+ *
+ * @param dir
+ * @return btinner*
+ */
+btinner *bt_newinner(directory *dir)
+{
+    btinner *n = (btinner *)calloc(1, sizeof(btinner));
+    dir_charge(dir, sizeof(btinner));
+    return n;
+}
 
 /**
- * @brief updates the file system
+ * @brief inserts an entry below a node, returns the new right sibling if the node split
  *
- * @return int
+ * @param dir
+ * @param at
+ * @param item
+ * @param name
+ * @param sep
+ * @return btnode*
  */
-int update_fs() 
+btnode *bt_insert_at(directory *dir, btnode *at, int item, const char *name, char **sep)
 {
-    FILE *myfs = fopen("myfs.txt", "w"); // Open a file named "myfs.txt" in write mode.
+    btnode *split;
+    int i, half = (BTREE_ORDER + 1) / 2;
 
-    // Loop through the inode table entries.
-    for (int i = 0; i < 16; ++i)
+    if (at->leaf)
     {
-        if (inodeTable[i].used == 1) // Check if the inode entry is in use.
+        btleaf *n = (btleaf *)at, *right;
+        i = bt_search(dir, n, name, 0);
+        if (n->hdr.count < n->cap)
         {
-            // Write the inode data to the file.
-            fprintf(myfs, "%d %d %s %d %d %d %d %d %d %d %d %d\n", i,
-                    inodeTable[i].dir, inodeTable[i].name, inodeTable[i].size,
-                    inodeTable[i].blockptrs[0], inodeTable[i].blockptrs[1],
-                    inodeTable[i].blockptrs[2], inodeTable[i].blockptrs[3],
-                    inodeTable[i].blockptrs[4], inodeTable[i].blockptrs[5],
-                    inodeTable[i].blockptrs[6], inodeTable[i].blockptrs[7]);
+            memmove(n->items + i + 1, n->items + i, (n->hdr.count - i) * sizeof(int));
+            n->items[i] = item;
+            ++n->hdr.count;
+            return NULL;
         }
-    }
 
-    // Write a divider line indicating the end of inode entries and the start of data entries.
-    fprintf(myfs, "-1 0 data 0 0 0 0 0 0 0 0 0\n");
+        // Full: the upper half moves to a new leaf, whose first name separates the two
+        int all[BTREE_ORDER + 1];
+        memcpy(all, n->items, i * sizeof(int));
+        all[i] = item;
+        memcpy(all + i + 1, n->items + i, (BTREE_ORDER - i) * sizeof(int));
+        right = bt_newleaf(dir, BTREE_ORDER);
+        right->hdr.count = BTREE_ORDER + 1 - half;
+        memcpy(n->items, all, half * sizeof(int));
+        memcpy(right->items, all + half, right->hdr.count * sizeof(int));
+        n->hdr.count = half;
+        right->next = n->next;
+        n->next = right;
+        *sep = strdup(entryname(dir, &dir->ents[right->items[0]]));
+        dir_charge(dir, strlen(*sep) + 1);
+        return &right->hdr;
+    }
 
-    node *item = NULL; // Declare a pointer to a node.
-    // Loop through the inode table entries again.
-    for (int i = 0; i < 16; ++i)
+    btinner *n = (btinner *)at, *right;
+    char *childSep;
+    i = bt_child(n, name);
+    split = bt_insert_at(dir, n->child[i], item, name, &childSep);
+    if (split == NULL)
     {
-        if (inodeTable[i].used == 1 && inodeTable[i].dir == 1) // Check if the inode entry is in use and a directory.
-        {
-            // Loop through the data table linked list associated with the inode.
-            for (int j = 0; j < length(dataTable[inodeTable[i].blockptrs[0]]); ++j)
-            {
-                item = get(dataTable[inodeTable[i].blockptrs[0]], j); // Get the j-th item from the data table.
-                // Write the data table entry to the file.
-                fprintf(myfs, "%d %s %d\n", inodeTable[i].blockptrs[0],
-                        item->data.name, item->data.inode);
-            }
-        }
+        return NULL;
+    }
+    if (n->hdr.count < BTREE_ORDER)
+    {
+        memmove(n->keys + i + 1, n->keys + i, (n->hdr.count - i) * sizeof(char *));
+        memmove(n->child + i + 2, n->child + i + 1, (n->hdr.count - i) * sizeof(btnode *));
+        n->keys[i] = childSep;
+        n->child[i + 1] = split;
+        ++n->hdr.count;
+        return NULL;
     }
 
-    fclose(myfs); // Close the file.
-    return 0; // Return success code.
+    // Full: the middle separator moves up, the ones above it go to a new node
+    char *keys[BTREE_ORDER + 1];
+    btnode *child[BTREE_ORDER + 2];
+    memcpy(keys, n->keys, i * sizeof(char *));
+    keys[i] = childSep;
+    memcpy(keys + i + 1, n->keys + i, (BTREE_ORDER - i) * sizeof(char *));
+    memcpy(child, n->child, (i + 1) * sizeof(btnode *));
+    child[i + 1] = split;
+    memcpy(child + i + 2, n->child + i + 1, (BTREE_ORDER - i) * sizeof(btnode *));
+    right = bt_newinner(dir);
+    n->hdr.count = half;
+    right->hdr.count = BTREE_ORDER - half;
+    memcpy(n->keys, keys, half * sizeof(char *));
+    memcpy(n->child, child, (half + 1) * sizeof(btnode *));
+    *sep = keys[half];
+    memcpy(right->keys, keys + half + 1, right->hdr.count * sizeof(char *));
+    memcpy(right->child, child + half + 1, (right->hdr.count + 1) * sizeof(btnode *));
+    return &right->hdr;
 }
 
 /**
- * @brief initializes the file system
+ * @brief adds an entry to the name index of a directory
  *
- * @return int
+ * A directory starts with a root leaf sized for a few entries, grown
+ * until it holds BTREE_ORDER; only then does the tree split.
+ *
+ * @param dir
+ * @param item
  */
-int init_fs()
+void bt_insert(directory *dir, int item)
 {
-    FILE *myfs = fopen("myfs.txt", "r"); // Open file in read mode.
-    int inode, dir, size, blockptrs[8], dataBlockIndex, flag = 1, rc = 1; // Declare variables.
-    char name[FILENAME_MAXLEN]; // Array to store file names.
+    char *sep;
+    btnode *split;
+    btleaf *root = (btleaf *)dir->index;
 
-    if (myfs == NULL) // Check if file doesn't previously exist.
+    if (root == NULL)
+    {
+        dir->index = &bt_newleaf(dir, BTREE_ORDER < 4 ? BTREE_ORDER : 4)->hdr; // '.', '..' and a couple more.
+    }
+    else if (root->hdr.leaf && root->hdr.count == root->cap && root->cap < BTREE_ORDER)
+    {
+        int cap = root->cap * 2 < BTREE_ORDER ? root->cap * 2 : BTREE_ORDER; // Double the root leaf.
+        root = (btleaf *)realloc(root, sizeof(btleaf) + cap * sizeof(int));
+        dir_charge(dir, (cap - root->cap) * sizeof(int));
+        root->cap = cap;
+        dir->index = &root->hdr;
+    }
+    split = bt_insert_at(dir, dir->index, item, entryname(dir, &dir->ents[item]), &sep);
+    if (split != NULL)
     {
-        myfs = fopen("myfs.txt", "w"); // Create and open file in write mode.
-        fclose(myfs); // Close file.
+        // The root split: the tree grows a level
+        btinner *top = bt_newinner(dir);
+        top->hdr.count = 1;
+        top->keys[0] = sep;
+        top->child[0] = dir->index;
+        top->child[1] = split;
+        dir->index = &top->hdr;
+    }
+}
 
-        // Initialize root inode.
-        inodeTable[0].used = 1;
-        inodeTable[0].dir = 1;
-        strcpy(inodeTable[0].name, "root");
-        inodeTable[0].size = 1;
-        dataBitmap[0] = 1;
-        push(&dataTable[0], 0, "."); // Push root directory entry.
+/**
+ * @brief removes an entry from the name index of a directory
+ *
+ * Nodes are not merged: separators stay valid bounds, an emptied leaf is
+ * skipped by iteration, and the tree is rebuilt packed at the next load.
+ * Entries after the removed one move down a position in the array, and
+ * so do their positions in the leaves.
+ *
+ * @param dir
+ * @param item
+ */
+void bt_remove(directory *dir, int item)
+{
+    char *name = entryname(dir, &dir->ents[item]);
+    btleaf *leaf = bt_leaf(dir, name), *first = bt_leaf(dir, "");
+    int i = bt_search(dir, leaf, name, 0);
 
-        update_fs(); // Update the file system.
+    // Equal names, which only a damaged directory has, may sit further right
+    for (; leaf != NULL; leaf = leaf->next, i = 0)
+    {
+        while (i < leaf->hdr.count && leaf->items[i] != item &&
+               strcmp(entryname(dir, &dir->ents[leaf->items[i]]), name) == 0)
+        {
+            ++i;
+        }
+        if (i < leaf->hdr.count && leaf->items[i] == item)
+        {
+            memmove(leaf->items + i, leaf->items + i + 1, (leaf->hdr.count - i - 1) * sizeof(int));
+            --leaf->hdr.count;
+            break;
+        }
+        if (i < leaf->hdr.count)
+        {
+            break; // Past the equal names.
+        }
     }
-    else // If file already exists.
+    for (leaf = first; leaf != NULL; leaf = leaf->next)
     {
-        while (rc != EOF)
+        for (i = 0; i < leaf->hdr.count; ++i)
         {
-            if (flag == 1)
-            {
-                // Read and parse inode table entries.
-                rc = fscanf(myfs, "%d %d %s %d %d %d %d %d %d %d %d %d", &inode,
-                            &dir, name, &size, &blockptrs[0], &blockptrs[1],
-                            &blockptrs[2], &blockptrs[3], &blockptrs[4],
-                            &blockptrs[5], &blockptrs[6], &blockptrs[7]);
-                if (inode == -1)
-                {
-                    flag = -1; // Set flag to indicate start of data entries.
-                }
-                else if (rc != EOF)
-                {
-                    strcpy(inodeTable[inode].name, name);
-                    inodeTable[inode].dir = dir;
-                    inodeTable[inode].used = 1;
-                    inodeTable[inode].size = size;
-                    for (int i = 0; i < size; ++i)
-                    {
-                        inodeTable[inode].blockptrs[i] = blockptrs[i];
-                        dataBitmap[i] = 1; // Set data block as used.
-                    }
-                }
-            }
-            else
-            {
-                // Read and parse data table entries.
-                rc = fscanf(myfs, "%d %s %d", &dataBlockIndex, name, &inode);
-                if (rc != EOF)
-                {
-                    push(&dataTable[dataBlockIndex], inode, name); // Add data entry to the linked list.
-                }
-            }
+            leaf->items[i] -= leaf->items[i] > item;
         }
-
-        fclose(myfs); // Close file.
     }
-    return 0; // Return success code.
 }
 
 /**
- * @brief creates a file
+ * @brief frees a name index
  *
- * @param path
- * @param size
- * @return int
+ * @param n
  */
-int CR(char *path, int size)
+void bt_free(btnode *n)
 {
-    if (size > 8)
-    {
-        printf("error: Size exceeds the limit 8\n"); // Check if size exceeds limit.
-        return -1; // Return error code.
-    }
-
-    int i = 0, n = 0; // Initialize variables.
-    char temp[64]; // Temporary string buffer.
-    strcpy(temp, path); // Copy path to temporary buffer.
-    char *token = strtok(temp, "/"), arr[16][8]; // Tokenize path and create array for path components.
-
-    // split the path by /
-    while (token != NULL)
+    if (n == NULL)
     {
-        strcpy(arr[n], token); // Copy token to array.
-        token = strtok(NULL, "/"); // Get next token.
-        ++n; // Increment count of path components.
+        return;
     }
-
-    int currentInode = 0; // Start from root inode.
-    node *item = NULL; // Node pointer.
-
-    // traverse the given path
-    for (i = 0; i < n - 1; ++i)
+    if (!n->leaf)
     {
-        item = find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[i]); // Find directory in path.
-        if (item == NULL)
+        btinner *inner = (btinner *)n;
+        for (int i = 0; i < n->count; ++i)
         {
-            printf("error: The directory %s in the given path does not exist!\n", arr[i]); // Directory not found.
-            return -1; // Return error code.
+            free(inner->keys[i]);
+        }
+        for (int i = 0; i <= n->count; ++i)
+        {
+            bt_free(inner->child[i]);
         }
-        currentInode = item->data.inode; // Update current inode.
     }
+    free(n);
+}
 
-    item = find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[i]); // Find target file.
+/**
+ * @brief rebuilds the name index of a directory with its leaves full
+ *
+ * Leaves filled in insertion order are split half full and stay about
+ * three quarters full; packed, an entry costs little more than its
+ * position. The order of the old leaves is kept, so nothing is compared.
+ * Only the new nodes are charged to the directory.
+ *
+ * @param dir
+ */
+void bt_pack(directory *dir)
+{
+    int n = 0, i, k, groups;
+    int *items = (int *)malloc(dir->count * sizeof(int));
+    btleaf *leaf, *prev = NULL;
 
-    // checks if target file already exists
-    if (item != NULL)
+    for (leaf = bt_leaf(dir, ""); leaf != NULL; leaf = leaf->next)
     {
-        printf("error: The file already exists!\n"); // File already exists.
-        return -1; // Return error code.
+        memcpy(items + n, leaf->items, leaf->hdr.count * sizeof(int));
+        n += leaf->hdr.count;
+    }
+    bt_free(dir->index); // Its charge was dropped by the caller.
+    if (n <= BTREE_ORDER)
+    {
+        leaf = bt_newleaf(dir, n < 4 ? 4 : n); // A lone root leaf grows as it fills.
+        memcpy(leaf->items, items, n * sizeof(int));
+        leaf->hdr.count = n;
+        dir->index = &leaf->hdr;
+        free(items);
+        return;
     }
 
-    i = 0;
-    int j = 0;
-    int k = 0;
-
-    // finds an unused inode
-    while (inodeTable[i].used != 0)
+    // Leaves share the entries evenly, each under the first name it holds
+    groups = (n + BTREE_ORDER - 1) / BTREE_ORDER;
+    btnode **level = (btnode **)malloc(groups * sizeof(btnode *));
+    int *first = (int *)malloc(groups * sizeof(int));
+    for (i = 0, k = 0; i < groups; ++i)
     {
-        ++i; // Move to the next inode.
-        if (i == 16)
+        leaf = bt_newleaf(dir, BTREE_ORDER);
+        leaf->hdr.count = n / groups + (i < n % groups);
+        memcpy(leaf->items, items + k, leaf->hdr.count * sizeof(int));
+        first[i] = items[k];
+        k += leaf->hdr.count;
+        if (prev != NULL)
         {
-            printf("error: All inodes in use!\n"); // All inodes are in use.
-            return -1; // Return error code.
+            prev->next = leaf;
         }
+        prev = leaf;
+        level[i] = &leaf->hdr;
     }
 
-    inodeTable[i].used = 1; // Mark inode as used.
-    inodeTable[i].dir = 0; // Set inode as a file, not directory.
-    strcpy(inodeTable[i].name, arr[n - 1]); // Copy name of file.
-    inodeTable[i].size = size; // Set size of file.
-
-    // finds unused data blocks
-    for (k = 0; k < size; ++k)
+    // Inner levels likewise, until one node is left
+    for (n = groups; n > 1; n = groups)
     {
-        while (dataBitmap[j] != 0)
+        groups = (n + BTREE_ORDER) / (BTREE_ORDER + 1);
+        for (i = 0, k = 0; i < groups; ++i)
         {
-            ++j; // Move to the next data block.
-            if (j == 127)
+            btinner *inner = bt_newinner(dir);
+            int children = n / groups + (i < n % groups);
+            inner->hdr.count = children - 1;
+            for (int c = 0; c < children; ++c)
             {
-                printf("error: Not enough space left!\n"); // No space left for data blocks.
-                return -1; // Return error code.
+                inner->child[c] = level[k + c];
+                if (c > 0)
+                {
+                    inner->keys[c - 1] = strdup(entryname(dir, &dir->ents[first[k + c]]));
+                    dir_charge(dir, strlen(inner->keys[c - 1]) + 1);
+                }
             }
+            level[i] = &inner->hdr;
+            first[i] = first[k];
+            k += children;
         }
-        inodeTable[i].blockptrs[k] = j; // Assign data block to inode.
-        dataBitmap[j] = 1; // Mark data block as used.
     }
-
-    // adds file to data block of parent
-    push(&dataTable[inodeTable[currentInode].blockptrs[0]], i, arr[n - 1]); // Add file to parent directory.
-    update_fs(); // Update the file system.
-    return 0; // Return success code.
+    dir->index = level[0];
+    free(level);
+    free(first);
+    free(items);
 }
 
 /**
- * @brief deletes a file
+ * @brief gives back the room a directory grew into but does not use
  *
- * @param path
- * @return int
+ * Called once its entries are read from the image; most directories are
+ * not written to again before they are evicted or the program exits.
+ *
+ * @param dir
  */
-int DL(char *path)
+void dir_trim(directory *dir)
 {
-    int i = 0, n = 0;
-    char temp[64];
-    strcpy(temp, path);
-    char *token = strtok(temp, "/"), arr[16][8];
+    if (dir->count == 0)
+    {
+        return; // Nothing is allocated.
+    }
+    dir_charge(dir, -dir->bytes); // Everything is charged anew.
+    dir->ents = (dirent *)realloc(dir->ents, dir->count * sizeof(dirent));
+    dir->cap = dir->count;
+    dir->names = (char *)realloc(dir->names, dir->namesLen);
+    dir->namesCap = dir->namesLen;
+    dir_charge(dir, dir->cap * sizeof(dirent) + dir->namesCap);
+    bt_pack(dir);
+}
 
-    // splits the path by /
-    while (token != NULL)
+/**
+ * @brief adds a new entry to the end of a directory
+ *
+ * @param dir
+ * @param inode
+ * @param name
+ */
+void push(directory *dir, int inode, char *name)
+{
+    int len = strlen(name); // Names are at most FILENAME_MAXLEN - 1 bytes.
+    if (dir->count == dir->cap)
     {
-        strcpy(arr[n], token); // Copy token to array.
-        token = strtok(NULL, "/"); // Get next token.
-        ++n; // Increment count of path components.
+        int cap = dir->cap == 0 ? 4 : dir->cap * 2; // '.', '..' and a couple more, doubled when full.
+        dir->ents = (dirent *)realloc(dir->ents, cap * sizeof(dirent));
+        dir_charge(dir, (cap - dir->cap) * sizeof(dirent));
+        dir->cap = cap;
     }
 
-    int currentInode = 0; // Start from root inode.
-    node *item = NULL; // Node pointer.
+    dirent *link = &dir->ents[dir->count++];
+    link->inode = inode; // Set the inode value in the entry.
+    link->nameoff = intern(dir, name, len); // Store the name in the arena.
+    link->namelen = len; // Set the length of the name.
+    link->hash = hash(name, len); // Precompute the hash of the name.
+    bt_insert(dir, dir->count - 1); // Index it by name.
+}
 
-    // traverse the path
-    for (i = 0; i < n - 1; ++i)
+/**
+ * @brief deletes the entry with given inode from a directory
+ *
+ * @param dir
+ * @param inode
+ * @return int
+ */
+int delete(directory *dir, int inode)
+{
+    int k = 0; // Position of the entry to delete.
+
+    while (k < dir->count && dir->ents[k].inode != inode)
     {
-        item = find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[i]); // Find directory in path.
-        if (item == NULL)
-        {
-            printf("error: The directory %s in the given path does not exist!\n", arr[i]); // Directory not found.
-            return -1; // Return error code.
-        }
-        currentInode = item->data.inode; // Update current inode.
+        ++k;
     }
-    item = find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[i]); // Find target item.
-
-    // check if target item exists and is a file
-    if (item == NULL)
+    if (k == dir->count)
     {
-        printf("error: The file does not exist!\n"); // File not found.
+        printf("Inode %d not in list\n", inode); // Inode not found in the directory.
         return -1; // Return error code.
     }
-    else if (inodeTable[item->data.inode].dir == 1)
+
+    bt_remove(dir, k); // Unindex it while its name is still in the arena.
+    dir->namesDead += dir->ents[k].namelen + 1; // Its name is now dead space.
+    memmove(dir->ents + k, dir->ents + k + 1, (dir->count - k - 1) * sizeof(dirent)); // Keep insertion order.
+    --dir->count;
+
+    if (dir->count == 0)
+    {
+        bt_free(dir->index); // Release the entries, index and arena of an empty directory.
+        dir->index = NULL;
+        free(dir->ents);
+        dir->ents = NULL;
+        dir->cap = 0;
+        free(dir->names);
+        dir->names = NULL;
+        dir->namesLen = dir->namesCap = dir->namesDead = 0;
+        dir_charge(dir, -dir->bytes); // Nothing is left.
+    }
+    else if (dir->namesDead > dir->namesLen / 2)
+    {
+        compact(dir); // Reclaim the arena once it is mostly dead space.
+    }
+    return 0; // Return success code.
+}
+
+/**
+ * @brief returns the number of entries of a directory
+ *
+ * @param dir
+ * @return int
+ */
+int length(directory *dir)
+{
+    return dir->count;
+}
+
+/**
+ * @brief returns the entry with given name from a directory
+ *
+ * The hashes are compared first, so only a name that is almost certainly
+ * the one looked up reaches strcmp.
+ *
+ * @param dir
+ * @param name
+ * @return dirent*
+ */
+dirent *find(directory *dir, char *name)
+{
+    btleaf *leaf = bt_leaf(dir, name); // Descend the name index.
+    if (leaf == NULL)
+    {
+        return NULL; // Empty directory.
+    }
+
+    int i = bt_search(dir, leaf, name, 0);
+    if (i < leaf->hdr.count)
+    {
+        dirent *item = &dir->ents[leaf->items[i]];
+        int len = strlen(name);
+        if (item->namelen == len && item->hash == hash(name, len) && strcmp(entryname(dir, item), name) == 0)
+        {
+            return item; // Return pointer to the entry with matching name.
+        }
+    }
+    return NULL; // Name not found.
+}
+
+/**
+ * @brief returns the entry at given index from a directory
+ *
+ * @param dir
+ * @param index
+ * @return dirent*
+ */
+dirent *get(directory *dir, int index)
+{
+    if (index < 0 || index >= dir->count)
+    {
+        return NULL; // Index out of bounds.
+    }
+    return &dir->ents[index]; // Return pointer to the entry at the specified index.
+}
+
+/**
+ * @brief frees the entries, index and arena of a block directory
+ *
+ * @param dir
+ */
+void dir_free(directory *dir)
+{
+    free(dir->ents);
+    bt_free(dir->index);
+    free(dir->names);
+    dir_charge(dir, -dir->bytes);
+    memset(dir, 0, sizeof(directory));
+}
+
+/**
+ * @brief splits a path by / into its components, stored in buf
+ *
+ * @param path
+ * @param buf
+ * @param arr
+ * @return int
+ */
+int split(char *path, char *buf, char *arr[])
+{
+    int n = 0;
+
+    if (strlen(path) >= PATH_MAXLEN)
+    {
+        printf("error: Path exceeds the limit %d\n", PATH_MAXLEN - 1); // Path does not fit in buf.
+        return -1; // Return error code.
+    }
+    strcpy(buf, path); // Copy path to buffer.
+    char *token = strtok(buf, "/");
+
+    while (token != NULL)
+    {
+        if (n == PATH_MAXDEPTH)
+        {
+            printf("error: Path exceeds the depth limit %d\n", PATH_MAXDEPTH); // Too many components.
+            return -1; // Return error code.
+        }
+        if (strlen(token) >= FILENAME_MAXLEN)
+        {
+            printf("error: Name exceeds the limit %d\n", FILENAME_MAXLEN - 1); // Component too long.
+            return -1; // Return error code.
+        }
+        arr[n] = token; // Components point into buf.
+        token = strtok(NULL, "/"); // Get next token.
+        ++n; // Increment count of path components.
+    }
+
+    return n; // Return the number of components.
+}
+
+directory dataTable[BLOCK_COUNT]; // Array of directories, indexed by data block.
+
+/*
+ * The inode table is stored as parallel arrays rather than an array of
+ * records, so table-wide scans only touch the field they test. The used
+ * and dir flags are bit packed, 64 inodes per word, and the rest of an
+ * inode is a flags byte, a size and its block map. That is 2 bits + 37
+ * bytes per inode, against 48 bytes for the record it replaces.
+ */
+unsigned long long inodeUsed[INODE_WORDS]; // One bit per inode, 1 if the inode is in use.
+unsigned long long inodeDir[INODE_WORDS];  // One bit per inode, 1 if it's a directory.
+unsigned char inodeFlags[INODE_COUNT];     // INODE_* flags of each inode.
+int inodeSize[INODE_COUNT];                // Size of each inode, in blocks.
+blockmap inodeBlocks[INODE_COUNT];         // Block pointers or inline contents of each inode.
+group groups[GROUP_COUNT]; // Allocation groups, each owning an inode range and a block range.
+int blockRefs[BLOCK_COUNT]; // Files referencing each data block beyond the first, if shared.
+fsstat stats; // Usage counters of the whole image.
+int dedup = 0; // 1 if copies share the data blocks of their source.
+int sparse = 0; // 1 if new files start as holes, taking no blocks.
+int *delayedInodes = NULL; // Files with reserved blocks, in creation order.
+int delayedCount = 0, delayedCap = 0;
+pthread_mutex_t delayedLock = PTHREAD_MUTEX_INITIALIZER; // Guards delayedInodes.
+int commitEvery = 1; // Commands between image writes.
+int pendingCommits = 0; // Commands since the last image write.
+int lockFd = -1; // Lock file coordinating the processes sharing the image.
+int lockHeld = -1; // F_RDLCK or F_WRLCK while this process holds the image lock, -1 otherwise (F_RDLCK is 0).
+unsigned long long generation = ~0ULL; // Image generation loaded in memory, none yet.
+int shardCount = 1; // Image files the groups are split across; --shards sets it for a new image.
+unsigned char shardDirty[GROUP_COUNT]; // 1 for each shard changed since it was last written.
+unsigned char shardDamaged[GROUP_COUNT]; // 1 for each shard a directory failed to be read back from; kept until FSCK.
+int intentPending = 0; // 1 while myfs.txt.intent holds a move some shard has not been written with.
+int fsckLoad = 0; // 1 to load a damaged image for FSCK, leaving bad records out instead of failing.
+int loadProblems = 0; // Bad records the last load left out, counted by FSCK.
+
+/**
+ * @brief returns a monotonic timestamp in nanoseconds
+ *
+ * @return long long
+ */
+long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief adds delta to a shared counter, returns its previous value
+ *
+ * @param counter
+ * @param delta
+ * @return int
+ */
+int count(int *counter, int delta)
+{
+    return __atomic_fetch_add(counter, delta, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief returns bit i of a bit array
+ *
+ * @param bits
+ * @param i
+ * @return int
+ */
+int test_bit(const unsigned long long *bits, int i)
+{
+    return (__atomic_load_n(&bits[i / 64], __ATOMIC_RELAXED) >> (i % 64)) & 1; // Shards load neighbouring bits in parallel.
+}
+
+/**
+ * @brief sets bit i of a bit array to value; neighbouring bits may belong to other groups, so it is atomic
+ *
+ * @param bits
+ * @param i
+ * @param value
+ */
+void set_bit(unsigned long long *bits, int i, int value)
+{
+    if (value)
+    {
+        __atomic_fetch_or(&bits[i / 64], 1ULL << (i % 64), __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_and(&bits[i / 64], ~(1ULL << (i % 64)), __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * @brief returns the first clear bit of a bit array in [lo, hi), or -1
+ *
+ * @param bits
+ * @param lo
+ * @param hi
+ * @return int
+ */
+int find_zero(const unsigned long long *bits, int lo, int hi)
+{
+    for (int w = lo / 64; w * 64 < hi; ++w)
+    {
+        unsigned long long free = ~bits[w];
+        if (w == lo / 64)
+        {
+            free &= ~0ULL << (lo % 64); // Ignore bits before lo.
+        }
+        if (free != 0)
+        {
+            int i = w * 64 + __builtin_ctzll(free); // Lowest clear bit of this word.
+            return i < hi ? i : -1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief returns the number of positions set in both bit arrays, over n words
+ *
+ * @param a
+ * @param b
+ * @param n
+ * @return int
+ */
+int count_both(const unsigned long long *a, const unsigned long long *b, int n)
+{
+    int count = 0;
+    for (int w = 0; w < n; ++w)
+    {
+        count += __builtin_popcountll(a[w] & b[w]); // Vectorizes to wide AND + popcount.
+    }
+    return count;
+}
+
+/**
+ * @brief returns 1 if the inode is in use
+ *
+ * @param inode
+ * @return int
+ */
+int inode_used(int inode)
+{
+    return test_bit(inodeUsed, inode);
+}
+
+/**
+ * @brief returns 1 if the inode is a directory
+ *
+ * @param inode
+ * @return int
+ */
+int inode_dir(int inode)
+{
+    return test_bit(inodeDir, inode);
+}
+
+/**
+ * @brief returns the allocation group an inode belongs to
+ *
+ * @param inode
+ * @return int
+ */
+int group_of(int inode)
+{
+    return inode / GROUP_INODES;
+}
+
+/**
+ * @brief returns the shard an allocation group belongs to, shards own contiguous runs of groups
+ *
+ * @param g
+ * @return int
+ */
+int shard_of(int g)
+{
+    return g / (GROUP_COUNT / shardCount);
+}
+
+/**
+ * @brief marks the shard holding an allocation group as changed, to be written at the next sync
+ *
+ * @param g
+ */
+void mark_dirty(int g)
+{
+    __atomic_store_n(&shardDirty[shard_of(g)], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief writes the file name of a shard's image to buf: myfs.txt for shard 0, myfs.txt.N for the others
+ *
+ * @param shard
+ * @param buf
+ */
+void shard_name(int shard, char *buf)
+{
+    if (shard == 0)
+    {
+        strcpy(buf, "myfs.txt");
+    }
+    else
+    {
+        sprintf(buf, "myfs.txt.%d", shard);
+    }
+}
+
+/**
+ * @brief returns 1 if the data block is in use
+ *
+ * @param block
+ * @return int
+ */
+int block_used(int block)
+{
+    group *g = &groups[block / GROUP_BLOCKS];
+    int j = block % GROUP_BLOCKS;
+    return (g->bitmap[j / 64] >> (j % 64)) & 1;
+}
+
+/**
+ * @brief resets the allocation groups to an empty image
+ *
+ */
+void init_groups()
+{
+    for (int g = 0; g < GROUP_COUNT; ++g)
+    {
+        memset(groups[g].bitmap, 0, sizeof(groups[g].bitmap));
+        groups[g].freeInodes = GROUP_INODES;
+        groups[g].freeBlocks = GROUP_BLOCKS;
+    }
+    memset(&stats, 0, sizeof(stats));
+    stats.freeInodes = INODE_COUNT;
+    stats.freeBlocks = BLOCK_COUNT;
+}
+
+/**
+ * @brief finds an unused inode, near its parent, marks it used and returns it
+ *
+ * @param parentInode
+ * @param dir
+ * @return int
+ */
+int alloc_inode(int parentInode, int dir)
+{
+    int goal = group_of(parentInode);
+
+    // Spread directories created in the root across groups, keep everything else with its parent
+    if (dir == 1 && parentInode == 0)
+    {
+        for (int g = 0; g < GROUP_COUNT; ++g)
+        {
+            if (groups[g].freeInodes > groups[goal].freeInodes)
+            {
+                goal = g; // Group with the most unused inodes.
+            }
+        }
+    }
+
+    for (int k = 0; k < GROUP_COUNT; ++k)
+    {
+        int g = (goal + k) % GROUP_COUNT;
+        if (__atomic_load_n(&groups[g].freeInodes, __ATOMIC_RELAXED) == 0)
+        {
+            continue; // Skip full groups without scanning them.
+        }
+
+        pthread_mutex_lock(&groups[g].lock);
+        int i = find_zero(inodeUsed, g * GROUP_INODES, (g + 1) * GROUP_INODES);
+        if (i != -1)
+        {
+            set_bit(inodeUsed, i, 1); // Mark inode as used.
+            set_bit(inodeDir, i, dir);
+            inodeSize[i] = 0;
+            inodeFlags[i] = 0;
+            --groups[g].freeInodes;
+            pthread_mutex_unlock(&groups[g].lock);
+            mark_dirty(g);
+            count(&stats.freeInodes, -1);
+            count(dir ? &stats.dirs : &stats.files, 1);
+            PROBE(inode_alloc, i, parentInode, dir);
+            return i;
+        }
+        pthread_mutex_unlock(&groups[g].lock);
+    }
+
+    printf("error: All inodes in use!\n"); // All inodes are in use.
+    return -1; // Return error code.
+}
+
+/**
+ * @brief marks an inode unused
+ *
+ * @param inode
+ */
+void free_inode(int inode)
+{
+    group *g = &groups[group_of(inode)];
+
+    PROBE(inode_free, inode, inodeSize[inode]);
+    pthread_mutex_lock(&g->lock);
+    set_bit(inodeUsed, inode, 0); // Mark inode as unused.
+    inodeSize[inode] = 0;
+    inodeFlags[inode] = 0;
+    ++g->freeInodes;
+    pthread_mutex_unlock(&g->lock);
+    mark_dirty(group_of(inode));
+    count(&stats.freeInodes, 1);
+    count(inode_dir(inode) ? &stats.dirs : &stats.files, -1);
+}
+
+/**
+ * @brief returns the number of unused data blocks in all groups
+ *
+ * @return int
+ */
+int free_blocks()
+{
+    return __atomic_load_n(&stats.freeBlocks, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief finds an unused data block, preferably in the goal group, marks it used and returns it
+ *
+ * The caller must hold a reservation for the block; others use alloc_block().
+ *
+ * @param goal
+ * @return int
+ */
+int claim_block(int goal)
+{
+    for (int k = 0; k < GROUP_COUNT; ++k)
+    {
+        int g = (goal + k) % GROUP_COUNT;
+        if (__atomic_load_n(&groups[g].freeBlocks, __ATOMIC_RELAXED) == 0)
+        {
+            continue; // Skip full groups without scanning them.
+        }
+
+        pthread_mutex_lock(&groups[g].lock);
+        for (int w = 0; w < GROUP_WORDS; ++w)
+        {
+            unsigned long long free = ~groups[g].bitmap[w];
+            if (w == GROUP_WORDS - 1 && GROUP_BLOCKS % 64 != 0)
+            {
+                free &= (1ULL << (GROUP_BLOCKS % 64)) - 1; // Ignore bits past the end of the group.
+            }
+            if (free != 0)
+            {
+                int j = w * 64 + __builtin_ctzll(free); // Lowest unused block in this word.
+                groups[g].bitmap[w] |= 1ULL << (j % 64); // Mark data block as used.
+                --groups[g].freeBlocks;
+                pthread_mutex_unlock(&groups[g].lock);
+                mark_dirty(g);
+                count(&stats.freeBlocks, -1);
+                PROBE(block_alloc, g * GROUP_BLOCKS + j, goal);
+                return g * GROUP_BLOCKS + j;
+            }
+        }
+        pthread_mutex_unlock(&groups[g].lock);
+    }
+
+    printf("error: Not enough space left!\n"); // No available data blocks.
+    return -1; // Return error code.
+}
+
+/**
+ * @brief allocates a data block that no reservation covers, returns it or -1
+ *
+ * Blocks promised to delayed files are off limits, so the flush always
+ * finds the blocks it reserved.
+ *
+ * @param goal
+ * @return int
+ */
+int alloc_block(int goal)
+{
+    if (count(&stats.reservedBlocks, 1) + 1 > free_blocks()) // Reserve it like any other block first.
+    {
+        count(&stats.reservedBlocks, -1);
+        printf("error: Not enough space left!\n"); // All free blocks are promised.
+        return -1; // Return error code.
+    }
+    int j = claim_block(goal);
+    count(&stats.reservedBlocks, -1);
+    return j;
+}
+
+/**
+ * @brief drops a reference to a data block, marking it unused with the last one
+ *
+ * @param block
+ */
+void free_block(int block)
+{
+    group *g = &groups[block / GROUP_BLOCKS];
+    int j = block % GROUP_BLOCKS;
+
+    PROBE(block_free, block);
+    pthread_mutex_lock(&g->lock);
+    if (blockRefs[block] > 0)
+    {
+        --blockRefs[block]; // Still in use by another file.
+        count(&stats.sharedRefs, -1);
+    }
+    else
+    {
+        g->bitmap[j / 64] &= ~(1ULL << (j % 64)); // Mark data block as unused.
+        ++g->freeBlocks;
+        mark_dirty(block / GROUP_BLOCKS);
+        count(&stats.freeBlocks, 1);
+    }
+    pthread_mutex_unlock(&g->lock);
+}
+
+/**
+ * @brief adds a reference to a data block in use
+ *
+ * @param block
+ */
+void share_block(int block)
+{
+    group *g = &groups[block / GROUP_BLOCKS];
+
+    pthread_mutex_lock(&g->lock);
+    ++blockRefs[block];
+    count(&stats.sharedRefs, 1);
+    pthread_mutex_unlock(&g->lock);
+}
+
+/**
+ * @brief rebuilds the block reference counts from the block pointers of all files
+ *
+ */
+void count_refs()
+{
+    unsigned long long seen[(BLOCK_COUNT + 63) / 64] = {0}; // Blocks already referenced once.
+
+    memset(blockRefs, 0, sizeof(blockRefs));
+    stats.sharedRefs = 0;
+    for (int i = 0; i < INODE_COUNT; ++i)
+    {
+        if (inode_used(i) && !inode_dir(i))
+        {
+            for (int k = 0; k < inodeSize[i]; ++k)
+            {
+                int j = inodeBlocks[i].blockptrs[k];
+                if (j < 0 || j >= BLOCK_COUNT)
+                {
+                    continue; // A hole, or a bad pointer left for FSCK.
+                }
+                if (test_bit(seen, j))
+                {
+                    ++blockRefs[j]; // A later file sharing the block.
+                    ++stats.sharedRefs;
+                }
+                set_bit(seen, j, 1);
+            }
+        }
+    }
+}
+
+/**
+ * @brief returns logical over physical blocks in use, 1 without sharing
+ *
+ * @return double
+ */
+double dedup_ratio()
+{
+    int used = BLOCK_COUNT - free_blocks();
+    return used == 0 ? 1.0 : (double)(used + stats.sharedRefs) / used;
+}
+
+/**
+ * @brief releases the data blocks and the inode of a file
+ *
+ * @param inode
+ */
+void free_file(int inode)
+{
+    for (int i = 0; i < inodeSize[inode]; ++i)
+    {
+        int j = inodeBlocks[inode].blockptrs[i];
+        if (j == BLOCK_DELAYED)
+        {
+            count(&stats.reservedBlocks, -1); // Drop the reservation.
+        }
+        else if (j != BLOCK_HOLE)
+        {
+            free_block(j); // Mark data block as unused.
+        }
+    }
+    free_inode(inode);
+}
+
+/**
+ * @brief allocates an inode for a new file of size blocks, returns the inode or -1
+ *
+ * No data blocks are chosen here. Each block is either reserved, to be
+ * assigned at the next flush by assign_delayed(), or left as a hole that
+ * takes no space. Holes are used in sparse mode, or where the source of
+ * a copy (srcInode, -1 for none) has one.
+ *
+ * @param parentInode
+ * @param size
+ * @param srcInode
+ * @return int
+ */
+int alloc_file(int parentInode, int size, int srcInode)
+{
+    int reserve = 0;
+    for (int k = 0; k < size; ++k)
+    {
+        reserve += srcInode == -1 ? !sparse : inodeBlocks[srcInode].blockptrs[k] != BLOCK_HOLE;
+    }
+
+    if (count(&stats.reservedBlocks, reserve) + reserve > free_blocks())
+    {
+        count(&stats.reservedBlocks, -reserve);
+        printf("error: Not enough space left!\n"); // No space left for data blocks.
+        return -1; // Return error code.
+    }
+
+    int i = alloc_inode(parentInode, 0);
+    if (i == -1)
+    {
+        count(&stats.reservedBlocks, -reserve);
+        return -1; // Return error code.
+    }
+
+    for (int k = 0; k < size; ++k)
+    {
+        int hole = srcInode == -1 ? sparse : inodeBlocks[srcInode].blockptrs[k] == BLOCK_HOLE;
+        inodeBlocks[i].blockptrs[k] = hole ? BLOCK_HOLE : BLOCK_DELAYED;
+    }
+    inodeSize[i] = size;
+
+    if (reserve > 0)
+    {
+        inodeFlags[i] |= INODE_DELAYED;
+        pthread_mutex_lock(&delayedLock);
+        if (delayedCount == delayedCap)
+        {
+            delayedCap = delayedCap == 0 ? 64 : delayedCap * 2;
+            delayedInodes = (int *)realloc(delayedInodes, delayedCap * sizeof(int));
+        }
+        delayedInodes[delayedCount++] = i; // Queue it for the next flush.
+        pthread_mutex_unlock(&delayedLock);
+    }
+
+    return i;
+}
+
+/**
+ * @brief claims n contiguous unused data blocks in group g, returns the first or -1
+ *
+ * @param g
+ * @param n
+ * @return int
+ */
+int alloc_run(int g, int n)
+{
+    int run = 0;
+
+    pthread_mutex_lock(&groups[g].lock);
+    for (int j = 0; j < GROUP_BLOCKS; ++j)
+    {
+        run = test_bit(groups[g].bitmap, j) ? 0 : run + 1;
+        if (run == n)
+        {
+            for (int k = j - n + 1; k <= j; ++k)
+            {
+                set_bit(groups[g].bitmap, k, 1); // Mark data block as used.
+            }
+            groups[g].freeBlocks -= n;
+            pthread_mutex_unlock(&groups[g].lock);
+            mark_dirty(g);
+            count(&stats.freeBlocks, -n);
+            PROBE(block_run, g * GROUP_BLOCKS + j - n + 1, n);
+            return g * GROUP_BLOCKS + j - n + 1;
+        }
+    }
+    pthread_mutex_unlock(&groups[g].lock);
+    return -1; // No run long enough.
+}
+
+/**
+ * @brief assigns data blocks to all reserved blocks, as contiguous runs in each file's group
+ *
+ * Files are handled in creation order, so files created together also
+ * end up next to each other. A block that cannot be found stays reserved
+ * and its file queued, so nothing is written over it as a hole.
+ *
+ * @return int
+ */
+int assign_delayed()
+{
+    int kept = 0;
+
+    pthread_mutex_lock(&delayedLock);
+    for (int d = 0; d < delayedCount; ++d)
+    {
+        int i = delayedInodes[d], n = 0, j = -1, left = 0;
+        if (!inode_used(i) || !(inodeFlags[i] & INODE_DELAYED))
+        {
+            continue; // Deleted, or already handled, since it was queued.
+        }
+
+        for (int k = 0; k < inodeSize[i]; ++k)
+        {
+            n += inodeBlocks[i].blockptrs[k] == BLOCK_DELAYED;
+        }
+        for (int k = 0; k < GROUP_COUNT && j == -1; ++k)
+        {
+            j = alloc_run((group_of(i) + k) % GROUP_COUNT, n); // One run for the whole file.
+        }
+
+        for (int k = 0; k < inodeSize[i]; ++k)
+        {
+            if (inodeBlocks[i].blockptrs[k] == BLOCK_DELAYED)
+            {
+                // Free space is fragmented: fall back to single blocks, which the reservation guarantees
+                int block = j != -1 ? j++ : claim_block(group_of(i));
+                if (block == -1)
+                {
+                    ++left; // Still reserved, tried again at the next flush.
+                    continue;
+                }
+                inodeBlocks[i].blockptrs[k] = block;
+                count(&stats.reservedBlocks, -1);
+            }
+        }
+        if (left > 0)
+        {
+            delayedInodes[kept++] = i;
+        }
+        else
+        {
+            inodeFlags[i] &= ~INODE_DELAYED;
+        }
+        mark_dirty(group_of(i));
+    }
+    delayedCount = kept;
+    pthread_mutex_unlock(&delayedLock);
+    return kept == 0 ? 0 : -1;
+}
+
+/**
+ * @brief allocates an inode for a copy of a file that shares its data blocks, returns the inode or -1
+ *
+ * Files have no contents besides their blocks, so a copy is identical to
+ * its source and can reference the same blocks without fingerprinting
+ * them; the blocks are released with their last reference.
+ *
+ * @param parentInode
+ * @param srcInode
+ * @return int
+ */
+int share_file(int parentInode, int srcInode)
+{
+    if (inodeFlags[srcInode] & INODE_DELAYED)
+    {
+        if (assign_delayed() == -1) // Reserved blocks have nothing to share yet.
+        {
+            return -1; // Return error code.
+        }
+    }
+
+    int i = alloc_inode(parentInode, 0);
+    if (i == -1)
+    {
+        return -1; // Return error code.
+    }
+
+    for (int k = 0; k < inodeSize[srcInode]; ++k)
+    {
+        if (inodeBlocks[srcInode].blockptrs[k] != BLOCK_HOLE)
+        {
+            share_block(inodeBlocks[srcInode].blockptrs[k]);
+        }
+        inodeBlocks[i].blockptrs[k] = inodeBlocks[srcInode].blockptrs[k];
+    }
+    inodeSize[i] = inodeSize[srcInode];
+    return i;
+}
+
+/**
+ * @brief returns the number of inline bytes in use by a directory's entries
+ *
+ * @param dirInode
+ * @return int
+ */
+int inline_used(int dirInode)
+{
+    return inodeBlocks[dirInode].inl[4]; // Byte 4 holds the used length of the entry area.
+}
+
+/**
+ * @brief makes an empty inline directory with the given parent
+ *
+ * @param dirInode
+ * @param parentInode
+ */
+void inline_init(int dirInode, int parentInode)
+{
+    memset(inodeBlocks[dirInode].inl, 0, INLINE_MAXLEN);
+    memcpy(inodeBlocks[dirInode].inl, &parentInode, sizeof(int)); // Bytes 0-3 hold '..'.
+    inodeFlags[dirInode] |= INODE_INLINE;
+    inodeSize[dirInode] = 0; // No blocks in use.
+    mark_dirty(group_of(dirInode));
+    count(&stats.inlineDirs, 1);
+}
+
+/**
+ * @brief moves the entries of an inline directory into a newly allocated block
+ *
+ * @param dirInode
+ * @return int
+ */
+int promote(int dirInode)
+{
+    unsigned char inl[INLINE_MAXLEN];
+    int parentInode, childInode, off = 5;
+    int j = alloc_block(group_of(dirInode)); // Keep the block with its directory.
+    if (j == -1)
+    {
+        return -1; // Return error code.
+    }
+
+    memcpy(inl, inodeBlocks[dirInode].inl, INLINE_MAXLEN); // Save entries, blockptrs overlay them.
+    memcpy(&parentInode, inl, sizeof(int));
+    memset(inodeBlocks[dirInode].blockptrs, 0, sizeof(inodeBlocks[dirInode].blockptrs));
+    inodeFlags[dirInode] &= ~INODE_INLINE;
+    count(&stats.inlineDirs, -1);
+    inodeBlocks[dirInode].blockptrs[0] = j; // Set block pointer.
+    inodeSize[dirInode] = 1;
+    mark_dirty(group_of(dirInode));
+    dir_free(&dataTable[j]); // Nothing of an earlier owner of the block is read back.
+
+    push(&dataTable[j], dirInode, "."); // Add '.' entry to data block.
+    if (parentInode != -1)
+    {
+        push(&dataTable[j], parentInode, ".."); // Add '..' entry to data block.
+    }
+    while (off < 5 + inl[4])
+    {
+        memcpy(&childInode, inl + off, sizeof(int));
+        push(&dataTable[j], childInode, (char *)inl + off + sizeof(int)); // Copy entry to data block.
+        off += sizeof(int) + strlen((char *)inl + off + sizeof(int)) + 1;
+    }
+    return 0; // Return success code.
+}
+
+unsigned int crcTable[8][256]; // Slicing-by-8 tables for the CRC32C polynomial.
+unsigned int (*crcKernel)(unsigned int, const unsigned char *, size_t); // Fastest kernel for this CPU.
+
+/**
+ * @brief portable CRC32C kernel, eight bytes per step using slicing-by-8 tables
+ *
+ * @param crc
+ * @param p
+ * @param len
+ * @return unsigned int
+ */
+unsigned int crc32c_table(unsigned int crc, const unsigned char *p, size_t len)
+{
+    while (len >= 8)
+    {
+        unsigned int lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crcTable[7][lo & 0xff] ^ crcTable[6][(lo >> 8) & 0xff] ^
+              crcTable[5][(lo >> 16) & 0xff] ^ crcTable[4][lo >> 24] ^
+              crcTable[3][hi & 0xff] ^ crcTable[2][(hi >> 8) & 0xff] ^
+              crcTable[1][(hi >> 16) & 0xff] ^ crcTable[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+    {
+        crc = crcTable[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if CONFIG_CRC_HW && defined(__x86_64__)
+/**
+ * @brief SSE4.2 CRC32C kernel, using the crc32 instruction on eight bytes at a time
+ *
+ * Records checksummed here are tens of bytes, where a PCLMUL or AVX-512
+ * folding kernel has no room to amortize its setup; the crc32 instruction
+ * is the fastest option at these sizes.
+ *
+ * @param crc
+ * @param p
+ * @param len
+ * @return unsigned int
+ */
+__attribute__((target("sse4.2"))) unsigned int crc32c_sse42(unsigned int crc, const unsigned char *p, size_t len)
+{
+    unsigned long long c = crc;
+    while (len >= 8)
+    {
+        unsigned long long v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+    {
+        c = _mm_crc32_u8((unsigned int)c, *p++);
+    }
+    return (unsigned int)c;
+}
+#endif
+
+/**
+ * @brief builds the CRC32C tables and picks the kernel for this CPU
+ *
+ */
+void crc32c_init()
+{
+    for (int n = 0; n < 256; ++n)
+    {
+        unsigned int crc = n;
+        for (int k = 0; k < 8; ++k)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1; // Reflected Castagnoli polynomial.
+        }
+        crcTable[0][n] = crc;
+    }
+    for (int n = 0; n < 256; ++n)
+    {
+        for (int k = 1; k < 8; ++k)
+        {
+            crcTable[k][n] = crcTable[0][crcTable[k - 1][n] & 0xff] ^ (crcTable[k - 1][n] >> 8);
+        }
+    }
+
+    crcKernel = crc32c_table;
+#if CONFIG_CRC_HW && defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crcKernel = crc32c_sse42;
+    }
+#endif
+}
+
+/**
+ * @brief returns the CRC32C of buf, continuing from crc (0 to start)
+ *
+ * @param crc
+ * @param buf
+ * @param len
+ * @return unsigned int
+ */
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len)
+{
+    return ~crcKernel(~crc, (const unsigned char *)buf, len);
+}
+
+/**
+ * @brief returns the checksum of an allocation group's summary and bitmap
+ *
+ * @param g
+ * @return unsigned int
+ */
+unsigned int group_crc(int g)
+{
+    unsigned int crc = crc32c(0, &groups[g].freeInodes, sizeof(int));
+    crc = crc32c(crc, &groups[g].freeBlocks, sizeof(int));
+    return crc32c(crc, groups[g].bitmap, sizeof(groups[g].bitmap));
+}
+
+/**
+ * @brief returns the checksum of an inode
+ *
+ * @param inode
+ * @return unsigned int
+ */
+unsigned int inode_crc(int inode)
+{
+    int fields[4] = {inode, inode_dir(inode), inodeSize[inode], inodeFlags[inode]};
+    unsigned int crc = crc32c(0, fields, sizeof(fields));
+    return crc32c(crc, &inodeBlocks[inode], sizeof(blockmap));
+}
+
+/**
+ * @brief returns the checksum of the entries of a directory block
+ *
+ * @param dir
+ * @return unsigned int
+ */
+unsigned int dir_crc(directory *dir)
+{
+    unsigned int crc = 0;
+    for (dirent *item = dir->ents; item < dir->ents + dir->count; ++item)
+    {
+        crc = crc32c(crc, &item->inode, sizeof(int));
+        crc = crc32c(crc, entryname(dir, item), item->namelen + 1);
+    }
+    return crc;
+}
+
+/**
+ * @brief reads the entries of an evicted block directory back from its shard's image, returns 0 or -1
+ *
+ * Threads of a traversal pool may fault the same directory at once; the
+ * first one reads it, the others find it resident once they get the lock.
+ * A directory that cannot be read back stays evicted, and its shard is
+ * not written again until FSCK has run, so its entries are not lost.
+ *
+ * @param dirInode
+ * @return int
+ */
+int dir_fault(int dirInode)
+{
+    int j = inodeBlocks[dirInode].blockptrs[0], block, ok = 0;
+    directory *dir = &dataTable[j];
+    unsigned int value;
+    long offset = dir->offset;
+    char name[FILENAME_MAXLEN], nameFormat[32], path[32];
+    sprintf(nameFormat, "%%d %%%ds %%u", FILENAME_MAXLEN - 1);
+
+    pthread_mutex_lock(&cache.lock);
+    if (!dir->evicted)
+    {
+        pthread_mutex_unlock(&cache.lock);
+        return 0; // Another thread read it first.
+    }
+
+    shard_name(shard_of(group_of(dirInode)), path);
+    FILE *myfs = fopen(path, "r");
+    if (myfs != NULL && fseek(myfs, offset, SEEK_SET) == 0)
+    {
+        // Entry lines up to the block's checksum line, as load_shard() reads them
+        while (fscanf(myfs, nameFormat, &block, name, &value) == 3 && block == j)
+        {
+            if (strcmp(name, "/") == 0)
+            {
+                ok = value == dir_crc(dir);
+                dir_trim(dir);
+                break;
+            }
+            push(dir, (int)value, name);
+        }
+    }
+    if (myfs != NULL)
+    {
+        fclose(myfs);
+    }
+    ++cache.faults;
+    if (!ok)
+    {
+        printf("error: Checksum mismatch in block %d, run --fsck repair!\n", j);
+        dir_free(dir); // Nothing half read is kept; the image still has the entries.
+        dir->offset = offset;
+        dir->evicted = 1;
+        shardDamaged[shard_of(group_of(dirInode))] = 1;
+        pthread_mutex_unlock(&cache.lock);
+        return -1;
+    }
+    __atomic_store_n(&dir->evicted, 0, __ATOMIC_RELEASE); // Entries are complete before they are seen.
+    pthread_mutex_unlock(&cache.lock);
+    return 0;
+}
+
+/**
+ * @brief returns the entries of a block directory, reading them back if evicted, or NULL if they cannot be
+ *
+ * @param dirInode
+ * @return directory*
+ */
+directory *dir_of(int dirInode)
+{
+    directory *dir = &dataTable[inodeBlocks[dirInode].blockptrs[0]];
+
+    if (__atomic_load_n(&dir->evicted, __ATOMIC_ACQUIRE) && dir_fault(dirInode) == -1)
+    {
+        return NULL; // Reported already.
+    }
+    if (cache.budget > 0)
+    {
+        __atomic_store_n(&dir->used, __atomic_add_fetch(&cache.tick, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    }
+    return dir;
+}
+
+/**
+ * @brief orders block directories by inode, least recently used first
+ *
+ * @param a
+ * @param b
+ * @return int
+ */
+int coldcmp(const void *a, const void *b)
+{
+    unsigned long long x = dataTable[inodeBlocks[*(const int *)a].blockptrs[0]].used;
+    unsigned long long y = dataTable[inodeBlocks[*(const int *)b].blockptrs[0]].used;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief drops the entries of the coldest directories until the resident size is back under budget
+ *
+ * Only directories of shards written since their last change are
+ * dropped, their entries are read back from the image. Trimming goes
+ * down to three quarters of the budget, so it does not run every command.
+ *
+ */
+void cache_trim()
+{
+    if (cache.budget == 0 || cache.resident <= cache.budget)
+    {
+        return; // Under budget.
+    }
+
+    int *cold = (int *)malloc(INODE_COUNT * sizeof(int)), n = 0;
+    for (int i = 0; i < INODE_COUNT; ++i)
+    {
+        if (inode_used(i) && inode_dir(i) && !(inodeFlags[i] & INODE_INLINE) &&
+            !shardDirty[shard_of(group_of(i))] && !dataTable[inodeBlocks[i].blockptrs[0]].evicted)
+        {
+            cold[n++] = i; // Resident and unchanged since written.
+        }
+    }
+    qsort(cold, n, sizeof(int), coldcmp);
+
+    for (int k = 0; k < n && cache.resident > cache.budget / 4 * 3; ++k)
+    {
+        directory *dir = &dataTable[inodeBlocks[cold[k]].blockptrs[0]];
+        long offset = dir->offset;
+        dir_free(dir);
+        dir->offset = offset; // Where the entries are read back from.
+        dir->evicted = 1;
+        ++cache.evictions;
+    }
+    free(cold);
+}
+
+/**
+ * @brief starts an iteration over the entries of a directory
+ *
+ * @param it
+ * @param dirInode
+ */
+void dir_open(diriter *it, int dirInode)
+{
+    directory *dir;
+
+    it->dirInode = dirInode;
+    it->off = -2; // Inline directories yield '.' and '..' first.
+    it->item = -1; // Also for a directory that cannot be read back.
+    if (!(inodeFlags[dirInode] & INODE_INLINE) && (dir = dir_of(dirInode)) != NULL)
+    {
+        it->item = 0;
+    }
+}
+
+/**
+ * @brief advances the iteration, returns 0 when there are no more entries
+ *
+ * @param it
+ * @return int
+ */
+int dir_next(diriter *it)
+{
+    blockmap *dir = &inodeBlocks[it->dirInode];
+
+    if (!(inodeFlags[it->dirInode] & INODE_INLINE))
+    {
+        directory *entries = &dataTable[dir->blockptrs[0]];
+        if (it->item == -1 || it->item >= entries->count)
+        {
+            return 0; // End of entries.
+        }
+        it->inode = entries->ents[it->item].inode;
+        it->name = entryname(entries, &entries->ents[it->item]);
+        ++it->item;
+        return 1;
+    }
+
+    if (it->off == -2)
+    {
+        it->off = -1;
+        it->inode = it->dirInode;
+        it->name = ".";
+        return 1;
+    }
+    if (it->off == -1)
+    {
+        it->off = 5;
+        memcpy(&it->inode, dir->inl, sizeof(int));
+        if (it->inode != -1) // The root has no '..'.
+        {
+            it->name = "..";
+            return 1;
+        }
+    }
+    if (it->off >= 5 + dir->inl[4])
+    {
+        return 0; // End of inline entries.
+    }
+    memcpy(&it->inode, dir->inl + it->off, sizeof(int));
+    it->name = (char *)dir->inl + it->off + sizeof(int);
+    it->off += sizeof(int) + strlen(it->name) + 1;
+    return 1;
+}
+
+/**
+ * @brief returns the inode of the entry with given name in a directory, or -1
+ *
+ * @param dirInode
+ * @param name
+ * @return int
+ */
+int dir_find(int dirInode, char *name)
+{
+    int inode = -1; // Name not found.
+
+    if (inodeFlags[dirInode] & INODE_INLINE)
+    {
+        diriter it;
+        dir_open(&it, dirInode);
+        while (dir_next(&it))
+        {
+            if (strcmp(it.name, name) == 0)
+            {
+                inode = it.inode;
+                break;
+            }
+        }
+    }
+    else
+    {
+        directory *dir = dir_of(dirInode);
+        dirent *item = dir == NULL ? NULL : find(dir, name);
+        inode = item == NULL ? -1 : item->inode;
+    }
+    PROBE(lookup, dirInode, name, inode);
+    return inode;
+}
+
+/**
+ * @brief adds an entry to a directory, promoting an inline directory that outgrows its inode
+ *
+ * @param dirInode
+ * @param childInode
+ * @param name
+ * @return int
+ */
+int dir_add(int dirInode, int childInode, char *name)
+{
+    blockmap *dir = &inodeBlocks[dirInode];
+    mark_dirty(group_of(dirInode)); // Entries are written with their directory's inode.
+    PROBE(dir_add, dirInode, childInode, name);
+
+    if (inodeFlags[dirInode] & INODE_INLINE)
+    {
+        int len = sizeof(int) + strlen(name) + 1; // Inline entry: inode, then name.
+        int used = inline_used(dirInode);
+        if (5 + used + len <= INLINE_MAXLEN)
+        {
+            memcpy(dir->inl + 5 + used, &childInode, sizeof(int));
+            strcpy((char *)dir->inl + 5 + used + sizeof(int), name);
+            dir->inl[4] = used + len;
+            return 0; // Return success code.
+        }
+        if (promote(dirInode) == -1)
+        {
+            return -1; // Return error code.
+        }
+    }
+
+    directory *entries = dir_of(dirInode);
+    if (entries == NULL)
+    {
+        return -1; // Return error code.
+    }
+    push(entries, childInode, name); // Add entry to the data block.
+    return 0; // Return success code.
+}
+
+/**
+ * @brief removes the entry for given inode from a directory
+ *
+ * @param dirInode
+ * @param childInode
+ * @return int
+ */
+int dir_remove(int dirInode, int childInode)
+{
+    blockmap *dir = &inodeBlocks[dirInode];
+    mark_dirty(group_of(dirInode));
+    PROBE(dir_remove, dirInode, childInode);
+
+    if (!(inodeFlags[dirInode] & INODE_INLINE))
+    {
+        directory *entries = dir_of(dirInode);
+        return entries == NULL ? -1 : delete (entries, childInode);
+    }
+
+    diriter it;
+    dir_open(&it, dirInode);
+    while (dir_next(&it))
+    {
+        if (it.inode == childInode && it.off > 5) // Skip the implied '.' and '..'.
+        {
+            int len = sizeof(int) + strlen(it.name) + 1;
+            int start = it.off - len;
+            memmove(dir->inl + start, dir->inl + it.off, 5 + dir->inl[4] - it.off); // Close the gap.
+            dir->inl[4] -= len;
+            return 0; // Return success code.
+        }
+    }
+    printf("Inode %d not in list\n", childInode); // Inode not found in list.
+    return -1; // Return error code.
+}
+
+/**
+ * @brief releases the entries of a directory, returns its data block or -1 if inline
+ *
+ * @param dirInode
+ * @return int
+ */
+int dir_drop(int dirInode)
+{
+    mark_dirty(group_of(dirInode));
+    if (inodeFlags[dirInode] & INODE_INLINE)
+    {
+        inodeFlags[dirInode] &= ~INODE_INLINE;
+        count(&stats.inlineDirs, -1);
+        return -1;
+    }
+
+    int j = inodeBlocks[dirInode].blockptrs[0];
+    dir_free(&dataTable[j]); // An evicted directory has nothing left to free.
+    return j;
+}
+
+/**
+ * @brief releases the entries of a directory and its data block
+ *
+ * @param dirInode
+ */
+void dir_release(int dirInode)
+{
+    int j = dir_drop(dirInode);
+    if (j != -1)
+    {
+        free_block(j); // Mark data block as unused.
+    }
+}
+
+/**
+ * @brief writes formatted text to the image and adds it to the running image checksum
+ *
+ * @param myfs
+ * @param crc
+ * @param format
+ */
+void emit(FILE *myfs, unsigned int *crc, const char *format, ...)
+{
+    char text[FILENAME_MAXLEN + 64]; // Fits any single field or entry line.
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    *crc = crc32c(*crc, text, len);
+    fputs(text, myfs);
+}
+
+/**
+ * @brief runs fn on the shards from first on, one thread each, only on changed ones unless all is set
+ *
+ * @param fn
+ * @param first
+ * @param all
+ * @return int
+ */
+int shard_run(void *(*fn)(void *), int first, int all)
+{
+    pthread_t threads[GROUP_COUNT];
+    shardJob jobs[GROUP_COUNT];
+    int started[GROUP_COUNT] = {0}, result = 0;
+
+    for (int s = shardCount - 1; s >= first; --s)
+    {
+        jobs[s].shard = s;
+        jobs[s].result = 0;
+        if (!all && !shardDirty[s])
+        {
+            continue; // Unchanged shards are left as they are.
+        }
+        if (s == first || pthread_create(&threads[s], NULL, fn, &jobs[s]) != 0)
+        {
+            fn(&jobs[s]); // The first shard, or one no thread took, done here.
+        }
+        else
+        {
+            started[s] = 1;
+        }
+    }
+    for (int s = first; s < shardCount; ++s)
+    {
+        if (started[s])
+        {
+            pthread_join(threads[s], NULL);
+        }
+        result |= jobs[s].result;
+    }
+    return result;
+}
+
+/**
+ * @brief copies the entry lines of a block, up to its checksum line, from one image to another, returns 0 or -1
+ *
+ * @param from
+ * @param offset
+ * @param to
+ * @param crc
+ * @return int
+ */
+int copy_entries(FILE *from, long offset, FILE *to, unsigned int *crc)
+{
+    char *line = NULL, name[FILENAME_MAXLEN], nameFormat[32];
+    size_t cap = 0;
+    int block, result = -1;
+    sprintf(nameFormat, "%%d %%%ds", FILENAME_MAXLEN - 1);
+
+    if (fseek(from, offset, SEEK_SET) == 0)
+    {
+        while (getline(&line, &cap, from) > 0 && sscanf(line, nameFormat, &block, name) == 2)
+        {
+            emit(to, crc, "%s", line);
+            if (strcmp(name, "/") == 0)
+            {
+                result = 0; // Checksum line of the block, copied last.
+                break;
+            }
+        }
+    }
+    free(line);
+    return result;
+}
+
+/**
+ * @brief writes the image of one shard: its groups, its inodes and the entries of its block directories
+ *
+ * The image is written to a temporary file that replaces the shard's file
+ * only once complete and on disk, so a crash mid-write leaves the previous
+ * image intact.
+ * Every group, inode and directory block line carries its own CRC32C,
+ * and a final line holds the CRC32C of the whole text before it.
+ *
+ * @param arg
+ * @return void*
+ */
+void *write_shard(void *arg)
+{
+    shardJob *job = arg;
+    int per = GROUP_COUNT / shardCount, lo = job->shard * per; // Groups of the shard.
+    char path[32], tmp[40];
+    unsigned int crc = 0; // Running checksum of the image text.
+
+    shard_name(job->shard, path);
+    job->result = -1;
+    if (shardDamaged[job->shard])
+    {
+        printf("error: %s has a directory that cannot be read, run --fsck repair!\n", path);
+        return NULL; // Its image is the only copy of those entries.
+    }
+    sprintf(tmp, "%s.tmp", path);
+    FILE *myfs = fopen(tmp, "w"); // Open a temporary file in write mode.
+    if (myfs == NULL)
+    {
+        printf("error: Cannot write %s!\n", path);
+        return NULL; // Return error code.
+    }
+
+    // Only a sharded image starts with its shard count, a single one keeps the original format
+    if (shardCount > 1 && job->shard == 0)
+    {
+        emit(myfs, &crc, "shards %d\n", shardCount);
+    }
+
+    // Write the summary and block bitmap of each allocation group.
+    for (int g = lo; g < lo + per; ++g)
+    {
+        emit(myfs, &crc, "%d %d %d", g, groups[g].freeInodes, groups[g].freeBlocks);
+        for (int w = 0; w < GROUP_WORDS; ++w)
+        {
+            emit(myfs, &crc, " %llx", groups[g].bitmap[w]);
+        }
+        emit(myfs, &crc, " %u\n", group_crc(g));
+    }
+
+    // Loop through the inode table entries of the shard.
+    for (int i = lo * GROUP_INODES; i < (lo + per) * GROUP_INODES; ++i)
+    {
+        if (inode_used(i)) // Check if the inode entry is in use.
+        {
+            // Write the inode data to the file; inline contents are written as the raw blockptrs words.
+            emit(myfs, &crc, "%d %d %d %d %d %d %d %d %d %d %d %d %u\n", i,
+                 inode_dir(i), inodeSize[i],
+                 inodeBlocks[i].blockptrs[0], inodeBlocks[i].blockptrs[1],
+                 inodeBlocks[i].blockptrs[2], inodeBlocks[i].blockptrs[3],
+                 inodeBlocks[i].blockptrs[4], inodeBlocks[i].blockptrs[5],
+                 inodeBlocks[i].blockptrs[6], inodeBlocks[i].blockptrs[7],
+                 inodeFlags[i], inode_crc(i));
+        }
+    }
+
+    // Write a divider line indicating the end of inode entries and the start of data entries.
+    emit(myfs, &crc, "-1 0 0 0 0 0 0 0 0 0 0 0 0\n");
+
+    directory *dir = NULL; // Declare a pointer to a directory.
+    FILE *prev = NULL; // Image being replaced, for the entries of evicted directories.
+    long *offsets = (long *)malloc(per * GROUP_INODES * sizeof(long)); // New entry positions.
+    int copied = 0;
+    // Loop through the inode table entries of the shard again.
+    for (int i = lo * GROUP_INODES; i < (lo + per) * GROUP_INODES; ++i)
+    {
+        if (inode_used(i) && inode_dir(i) &&
+            !(inodeFlags[i] & INODE_INLINE)) // Check if the inode entry is in use and a block directory.
+        {
+            dir = &dataTable[inodeBlocks[i].blockptrs[0]];
+            offsets[i - lo * GROUP_INODES] = ftell(myfs);
+            if (dir->evicted)
+            {
+                // Entries never read back are copied as they are, with their checksum line
+                if (prev == NULL)
+                {
+                    prev = fopen(path, "r");
+                }
+                copied = prev == NULL ? -1 : copy_entries(prev, dir->offset, myfs, &crc);
+                if (copied == -1)
+                {
+                    break;
+                }
+                continue;
+            }
+            // Loop through the entries of the directory, in insertion order.
+            for (dirent *item = dir->ents; item < dir->ents + dir->count; ++item)
+            {
+                // Write the data table entry to the file.
+                emit(myfs, &crc, "%d %s %d\n", inodeBlocks[i].blockptrs[0],
+                     entryname(dir, item), item->inode);
+            }
+            // Close the block with its checksum; '/' cannot be an entry name.
+            emit(myfs, &crc, "%d / %u\n", inodeBlocks[i].blockptrs[0], dir_crc(dir));
+        }
+    }
+    if (prev != NULL)
+    {
+        fclose(prev);
+    }
+
+    fprintf(myfs, "-1 / %u\n", crc); // Checksum of the whole image.
+    int synced = fflush(myfs) == 0 && fsync(fileno(myfs)) == 0; // Contents on disk before the rename.
+    if (fclose(myfs) != 0 || !synced || copied == -1 || rename(tmp, path) != 0) // Replace the image in one step.
+    {
+        printf("error: Cannot write %s!\n", path);
+        free(offsets);
+        return NULL; // Return error code.
+    }
+
+    // Evicted directories are read back from where this image put them
+    for (int i = lo * GROUP_INODES; i < (lo + per) * GROUP_INODES; ++i)
+    {
+        if (inode_used(i) && inode_dir(i) && !(inodeFlags[i] & INODE_INLINE))
+        {
+            dataTable[inodeBlocks[i].blockptrs[0]].offset = offsets[i - lo * GROUP_INODES];
+        }
+    }
+    free(offsets);
+    job->result = 0;
+    return NULL; // Return success code.
+}
+
+/**
+ * @brief flushes the directory holding the image, so renames into it survive a crash
+ *
+ * @return int
+ */
+int sync_dir()
+{
+    int fd = open(".", O_RDONLY | O_DIRECTORY);
+    int synced = fd != -1 && fsync(fd) == 0;
+
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    if (!synced)
+    {
+        printf("error: Cannot sync the image directory!\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief assigns reserved blocks and writes the image
+ *
+ * A single image is written whole. A sharded one writes only the shards
+ * changed since their last write, each on a thread of its own.
+ *
+ * @return int
+ */
+int sync_fs()
+{
+    long long begin = PROBE_CLOCK(sync_end);
+    int result = -1;
+
+    PROBE(sync_begin, pendingCommits, delayedCount);
+    int assigned = assign_delayed(); // Reserved blocks get their final place now, in contiguous runs.
+    pendingCommits = 0;
+
+    // An image is never written with a reserved block left unassigned; shards not written stay marked
+    if (assigned == 0 && shard_run(write_shard, 0, shardCount == 1) == 0 && sync_dir() == 0)
+    {
+        memset(shardDirty, 0, sizeof(shardDirty));
+        if (intentPending)
+        {
+            unlink("myfs.txt.intent"); // Both shards of the logged move are durably written.
+            intentPending = 0;
+        }
+
+        // Tell the other processes their copy is stale; they hold no lock while this one writes
+        ++generation;
+        if (pwrite(lockFd, &generation, sizeof(generation), 0) != sizeof(generation))
+        {
+            printf("error: Cannot write myfs.txt.lock!\n");
+        }
+        else
+        {
+            result = 0; // Return success code.
+        }
+    }
+    PROBE(sync_end, result, PROBE_SINCE(begin));
+    return result;
+}
+
+/**
+ * @brief updates the file system, writing the image once commitEvery commands have changed it
+ *
+ * @return int
+ */
+int update_fs()
+{
+    if (++pendingCommits < commitEvery)
+    {
+        return 0; // Batched with later commands.
+    }
+    return sync_fs();
+}
+
+/**
+ * @brief empties the in-memory image before a load
+ */
+void reset_fs()
+{
+    for (int j = 0; j < BLOCK_COUNT; ++j)
+    {
+        dir_free(&dataTable[j]);
+    }
+    memset(inodeUsed, 0, sizeof(inodeUsed));
+    memset(inodeDir, 0, sizeof(inodeDir));
+    memset(inodeFlags, 0, sizeof(inodeFlags));
+    memset(inodeSize, 0, sizeof(inodeSize));
+    memset(inodeBlocks, 0, sizeof(inodeBlocks));
+    memset(shardDirty, 0, sizeof(shardDirty));
+    memset(shardDamaged, 0, sizeof(shardDamaged));
+    delayedCount = 0;
+    pendingCommits = 0;
+    intentPending = 0;
+    loadProblems = 0;
+    init_groups(); // Start from empty allocation groups.
+}
+
+/**
+ * @brief reports a bad record found while loading, returns 1 if the load goes on without it
+ *
+ * A normal load stops at the first one. A load for FSCK counts it as a
+ * problem and goes on, so the check and the repair see what survives.
+ *
+ * @param format
+ * @param ...
+ * @return int
+ */
+int load_bad(const char *format, ...)
+{
+    char buf[FILENAME_MAXLEN + 64];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    if (!fsckLoad)
+    {
+        printf("error: %s!\n", buf);
+        return 0;
+    }
+    printf("fsck: %s\n", buf); // One call, so lines of different shards do not mix.
+    count(&loadProblems, 1);
+    return 1;
+}
+
+/**
+ * @brief loads the image of one shard, checking each record
+ *
+ * Shard 0 is loaded first: a sharded image starts with its shard count.
+ * The other shards are loaded in parallel, they touch disjoint groups,
+ * inodes and directory blocks. Bad records end the load, unless it is
+ * one for FSCK, see load_bad().
+ *
+ * @param arg
+ * @return void*
+ */
+void *load_shard(void *arg)
+{
+    shardJob *job = arg;
+    int inode, dir, size, blockptrs[BLOCK_PTRS], flags, dataBlockIndex, flag = 1, g = 0, lo = 0; // Declare variables.
+    int block = -1, lazy = 0, fields; // Block whose entries are being read, and whether they are left on disk.
+    unsigned int crc = 0, recordCrc = 0, blockCrc = 0; // Running image and block checksums, and the one on a line.
+    long pos = 0; // Position of the current line.
+    char name[FILENAME_MAXLEN]; // Array to store file names.
+    char nameFormat[32]; // Format reading at most FILENAME_MAXLEN - 1 chars of a name.
+    char path[32];
+    char *line = NULL, *field; // Current line of the image.
+    size_t cap = 0;
+    ssize_t len;
+    sprintf(nameFormat, "%%d %%%ds %%u", FILENAME_MAXLEN - 1);
+
+    shard_name(job->shard, path);
+    FILE *myfs = fopen(path, "r"); // Open file in read mode.
+    job->result = -1;
+    if (myfs == NULL)
+    {
+        job->result = load_bad("%s is missing", path) ? 0 : -1;
+        return NULL;
+    }
+
+    // Read the image line by line, checking each record
+    while ((len = getline(&line, &cap, myfs)) > 0)
+    {
+        if (job->shard == 0 && g == 0 && strncmp(line, "shards ", 7) == 0)
+        {
+            // Shard count of a sharded image.
+            shardCount = atoi(line + 7);
+            if (shardCount < 1 || GROUP_COUNT % shardCount != 0)
+            {
+                shardCount = 1;
+                break;
+            }
+        }
+        else if (g < GROUP_COUNT / shardCount)
+        {
+            // Read the allocation group summaries and bitmaps.
+            lo = job->shard * (GROUP_COUNT / shardCount); // First group of the shard.
+            field = line;
+            strtol(field, &field, 10); // Group index, implied by position.
+            groups[lo + g].freeInodes = strtol(field, &field, 10);
+            groups[lo + g].freeBlocks = strtol(field, &field, 10);
+            for (int w = 0; w < GROUP_WORDS; ++w)
+            {
+                groups[lo + g].bitmap[w] = strtoull(field, &field, 16);
+            }
+            // Totals follow the group summaries.
+            count(&stats.freeInodes, -(GROUP_INODES - groups[lo + g].freeInodes));
+            count(&stats.freeBlocks, -(GROUP_BLOCKS - groups[lo + g].freeBlocks));
+            recordCrc = strtoul(field, &field, 10);
+            if (recordCrc != group_crc(lo + g) && !load_bad("Checksum mismatch in group %d", lo + g))
+            {
+                break; // FSCK rebuilds the groups from the inodes.
+            }
+            ++g;
+        }
+        else if (flag == 1)
+        {
+            // Read and parse inode table entries.
+            fields = sscanf(line, "%d %d %d %d %d %d %d %d %d %d %d %d %u", &inode,
+                            &dir, &size, &blockptrs[0], &blockptrs[1],
+                            &blockptrs[2], &blockptrs[3], &blockptrs[4],
+                            &blockptrs[5], &blockptrs[6], &blockptrs[7], &flags, &recordCrc);
+            if (fields != 13)
+            {
+                if (!load_bad("Damaged inode record in %s", path))
+                {
+                    break;
+                }
+            }
+            else if (inode == -1)
+            {
+                flag = -1; // Set flag to indicate start of data entries.
+            }
+            else if (inode < 0 || inode >= INODE_COUNT || shard_of(group_of(inode)) != job->shard)
+            {
+                if (!load_bad("Invalid inode %d in %s", inode, path))
+                {
+                    break;
+                }
+            }
+            else
+            {
+                set_bit(inodeDir, inode, dir);
+                set_bit(inodeUsed, inode, 1);
+                inodeSize[inode] = size;
+                inodeFlags[inode] = flags;
+                memcpy(inodeBlocks[inode].blockptrs, blockptrs, sizeof(blockptrs)); // Also restores inline contents.
+                if (recordCrc != inode_crc(inode))
+                {
+                    set_bit(inodeUsed, inode, 0); // Left out; what it held turns up as damage elsewhere.
+                    set_bit(inodeDir, inode, 0);
+                    inodeSize[inode] = inodeFlags[inode] = 0;
+                    memset(&inodeBlocks[inode], 0, sizeof(blockmap));
+                    if (!load_bad("Checksum mismatch in inode %d", inode))
+                    {
+                        break;
+                    }
+                }
+                else
+                {
+                    count(dir ? &stats.dirs : &stats.files, 1);
+                    count(&stats.inlineDirs, (flags & INODE_INLINE) != 0);
+                }
+            }
+        }
+        else
+        {
+            // Read and parse data table entries.
+            fields = sscanf(line, nameFormat, &dataBlockIndex, name, &recordCrc);
+            if (fields == 3 && strcmp(name, "/") == 0 && dataBlockIndex == -1)
+            {
+                flag = 0; // Whole image checksum, checked below.
+                break;
+            }
+            if (fields != 3 || dataBlockIndex < 0 || dataBlockIndex >= BLOCK_COUNT)
+            {
+                if (!load_bad("Invalid entry of block %d in %s", fields > 0 ? dataBlockIndex : -1, path))
+                {
+                    break;
+                }
+            }
+            else
+            {
+                if (dataBlockIndex != block)
+                {
+                    // First line of a block; over budget, its entries are only checked and read back when used
+                    block = dataBlockIndex;
+                    blockCrc = 0;
+                    lazy = !fsckLoad && cache.budget > 0 &&
+                           __atomic_load_n(&cache.resident, __ATOMIC_RELAXED) >= cache.budget;
+                    dataTable[block].offset = pos;
+                }
+                if (strcmp(name, "/") == 0)
+                {
+                    // Entries that fail it are still checked one by one by FSCK
+                    if (recordCrc != (lazy ? blockCrc : dir_crc(&dataTable[dataBlockIndex])) &&
+                        !load_bad("Checksum mismatch in block %d", dataBlockIndex))
+                    {
+                        break;
+                    }
+                    dataTable[block].evicted = lazy;
+                    dir_trim(&dataTable[block]);
+                    block = -1;
+                }
+                else if (lazy)
+                {
+                    inode = (int)recordCrc; // Checksummed as dir_crc() would.
+                    blockCrc = crc32c(blockCrc, &inode, sizeof(int));
+                    blockCrc = crc32c(blockCrc, name, strlen(name) + 1);
+                }
+                else
+                {
+                    push(&dataTable[dataBlockIndex], (int)recordCrc, name); // Add data entry to the directory.
+                }
+            }
+        }
+        crc = crc32c(crc, line, len); // Everything up to the last line is covered by the image checksum.
+        pos += len;
+    }
+
+    free(line);
+    fclose(myfs); // Close file.
+
+    // A torn or truncated image ends before its checksum line, or fails it
+    if ((flag != 0 || recordCrc != crc) && !load_bad("%s is corrupt", path))
+    {
+        return NULL; // Return error code.
+    }
+    job->result = 0;
+    return NULL; // Return success code.
+}
+
+/**
+ * @brief logs a move between two shards before either is written, returns 0 or -1
+ *
+ * The move changes the image files of both shards, which are replaced one
+ * at a time. The log is flushed to disk first and removed once both are
+ * written, so a crash in between is finished by the next load.
+ *
+ * @param srcDir
+ * @param item
+ * @param dstDir
+ * @param name
+ * @return int
+ */
+int intent_write(int srcDir, int item, int dstDir, char *name)
+{
+    char text[FILENAME_MAXLEN + 64];
+    int len = snprintf(text, sizeof(text), "%d %d %d %s", srcDir, item, dstDir, name);
+    FILE *log = fopen("myfs.txt.intent", "w");
+
+    if (log == NULL)
+    {
+        printf("error: Cannot write myfs.txt.intent!\n");
+        return -1;
+    }
+    fprintf(log, "%s %u\n", text, crc32c(0, text, len));
+    int synced = fflush(log) == 0 && fsync(fileno(log)) == 0; // On disk before either shard changes.
+    if (fclose(log) != 0 || !synced)
+    {
+        printf("error: Cannot write myfs.txt.intent!\n");
+        unlink("myfs.txt.intent");
+        return -1;
+    }
+    intentPending = 1;
+    return 0;
+}
+
+/**
+ * @brief rolls forward a move between shards that a crash interrupted, returns 0 or -1
+ *
+ * Whichever shard was written, the entry ends up in the destination
+ * only. A writer writes the shards right away; a reader fixes its own
+ * copy and leaves the log for the next writer.
+ *
+ * @param write
+ * @return int
+ */
+int intent_replay(int write)
+{
+    char text[FILENAME_MAXLEN + 64], name[FILENAME_MAXLEN], format[32];
+    int srcDir, item, dstDir, there, here = 0;
+    unsigned int crc;
+    diriter it;
+    FILE *log = fopen("myfs.txt.intent", "r");
+
+    if (log == NULL)
+    {
+        return 0; // No move in flight.
+    }
+    sprintf(format, "%%d %%d %%d %%%ds %%u", FILENAME_MAXLEN - 1);
+    int fields = fscanf(log, format, &srcDir, &item, &dstDir, name, &crc);
+    fclose(log);
+    intentPending = 1; // Removed by the next write, whatever it holds.
+
+    // A torn log was never followed by a shard write
+    int len = snprintf(text, sizeof(text), "%d %d %d %s", srcDir, item, dstDir, name);
+    if (fields != 5 || crc != crc32c(0, text, len) ||
+        srcDir < 0 || srcDir >= INODE_COUNT || dstDir < 0 || dstDir >= INODE_COUNT ||
+        item < 0 || item >= INODE_COUNT || !inode_dir(srcDir) || !inode_dir(dstDir) || !inode_used(item))
+    {
+        return 0;
+    }
+
+    there = dir_find(dstDir, name);
+    if (there != -1 && there != item)
+    {
+        return 0; // The name was taken since, keep the source entry.
+    }
+    if (there == -1 && dir_add(dstDir, item, name) == -1)
+    {
+        return -1;
+    }
+    dir_open(&it, srcDir);
+    while (dir_next(&it))
+    {
+        here |= it.inode == item && strcmp(it.name, ".") != 0 && strcmp(it.name, "..") != 0;
+    }
+    if (here)
+    {
+        dir_remove(srcDir, item);
+    }
+    return write ? sync_fs() : 0;
+}
+
+/**
+ * @brief loads the image, or creates an empty one if it is missing and create is set
+ *
+ * @param create
+ * @return int
+ */
+int load_fs(int create)
+{
+    shardJob job = {0, 0};
+
+    reset_fs(); // Drop what an earlier load left.
+
+    if (create && access("myfs.txt", F_OK) != 0) // Check if file doesn't previously exist.
+    {
+        // Initialize root inode.
+        set_bit(inodeUsed, 0, 1);
+        set_bit(inodeDir, 0, 1);
+        --groups[0].freeInodes;
+        count(&stats.freeInodes, -1);
+        count(&stats.dirs, 1);
+        inline_init(0, -1); // Root starts inline, with no '..'.
+
+        memset(shardDirty, 1, shardCount); // Every shard gets its file.
+        return sync_fs(); // Write the new image.
+    }
+
+    shardCount = 1; // Unless the image says otherwise.
+    load_shard(&job);
+    if (job.result == -1 || shard_run(load_shard, 1, 1) == -1)
+    {
+        return -1; // Return error code.
+    }
+    count_refs(); // Blocks shared by copies are listed by each of them.
+    return intent_replay(create);
+}
+
+/**
+ * @brief releases the image lock, unless commits are still pending
+ */
+void fs_unlock()
+{
+    struct flock fl = {.l_type = F_UNLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 1};
+
+    if (lockHeld == -1 || pendingCommits > 0)
+    {
+        return;
+    }
+    fcntl(lockFd, F_SETLK, &fl);
+    lockHeld = -1;
+}
+
+/**
+ * @brief takes the image lock, shared to read or exclusive to write, reloading a stale image
+ *
+ * Processes sharing the image hold a byte-range lock on myfs.txt.lock for
+ * each command. The lock file also holds the image generation, bumped on
+ * every write, so a process reloads only when another one has written.
+ * With commits batched the exclusive lock is kept until the batch is written.
+ *
+ * @param write
+ * @return int
+ */
+int fs_lock(int write)
+{
+    struct flock fl = {.l_type = write ? F_WRLCK : F_RDLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 1};
+    struct timespec backoff = {0, 1000000}; // Wait after a reported deadlock, doubled on each one.
+    unsigned long long current = 0;
+
+    if (lockHeld == F_WRLCK)
+    {
+        return 0; // Still held for a batch of commits.
+    }
+    // Nothing is held here, so a reported deadlock involves other processes; back off and retry
+    while (fcntl(lockFd, F_SETLKW, &fl) == -1)
+    {
+        if (errno == EDEADLK && backoff.tv_nsec < 512000000)
+        {
+            nanosleep(&backoff, NULL);
+            backoff.tv_nsec *= 2;
+        }
+        else if (errno != EINTR)
+        {
+            printf("error: Cannot lock myfs.txt.lock!\n");
+            return -1;
+        }
+    }
+    lockHeld = fl.l_type;
+
+    // An empty lock file is generation 0; only a writer may create a missing image
+    if (pread(lockFd, &current, sizeof(current), 0) == -1)
+    {
+        printf("error: Cannot read myfs.txt.lock!\n");
+        fs_unlock();
+        return -1;
+    }
+    if (current != generation)
+    {
+        generation = current;
+        if (load_fs(write) == -1)
+        {
+            generation = ~0ULL; // Nothing usable is loaded.
+            fs_unlock();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief initializes the file system
+ *
+ * @return int
+ */
+int init_fs()
+{
+    crc32c_init(); // Pick the checksum kernel.
+    for (int g = 0; g < GROUP_COUNT; ++g)
+    {
+        pthread_mutex_init(&groups[g].lock, NULL);
+    }
+
+    lockFd = open("myfs.txt.lock", O_RDWR | O_CREAT, 0644);
+    if (lockFd == -1)
+    {
+        printf("error: Cannot open myfs.txt.lock!\n");
+        return -1;
+    }
+    if (fs_lock(1) == -1) // Loads the image, creating it if missing.
+    {
+        return -1;
+    }
+    fs_unlock();
+    return 0;
+}
+
+/**
+ * @brief walks the first n components of a path from the root, returns the inode reached or -1
+ *
+ * @param arr
+ * @param n
+ * @return int
+ */
+int walk(char *arr[], int n)
+{
+    int currentInode = 0; // Start from root inode.
+
+    for (int i = 0; i < n; ++i)
+    {
+        int childInode = dir_find(currentInode, arr[i]); // Find directory in path.
+        PROBE(walk_step, i, currentInode, childInode);
+        if (childInode == -1 || !inode_dir(childInode))
+        {
+            printf("error: The directory %s in the given path does not exist!\n", arr[i]); // Directory not found.
+            return -1; // Return error code.
+        }
+        currentInode = childInode; // Update current inode.
+    }
+
+    return currentInode;
+}
+
+/**
+ * @brief creates a file
+ *
+ * @param path
+ * @param size
+ * @return int
+ */
+int CR(char *path, int size)
+{
+    if (size > BLOCK_PTRS)
+    {
+        printf("error: Size exceeds the limit %d\n", BLOCK_PTRS); // Check if size exceeds limit.
+        return -1; // Return error code.
+    }
+
+    int i = 0; // Initialize variables.
+    char temp[PATH_MAXLEN], *arr[PATH_MAXDEPTH]; // Path buffer and array for path components.
+
+    // split the path by /
+    int n = split(path, temp, arr);
+    if (n <= 0)
+    {
+        if (n == 0)
+        {
+            printf("error: The file already exists!\n"); // Path names the root directory.
+        }
+        return -1; // Return error code.
+    }
+
+    // traverse the given path
+    int currentInode = walk(arr, n - 1);
+    if (currentInode == -1)
+    {
+        return -1; // Return error code.
+    }
+
+    // checks if target file already exists
+    if (dir_find(currentInode, arr[n - 1]) != -1)
+    {
+        printf("error: The file already exists!\n"); // File already exists.
+        return -1; // Return error code.
+    }
+
+    // finds an unused inode near the parent directory and reserves its blocks
+    i = alloc_file(currentInode, size, -1);
+    if (i == -1)
+    {
+        return -1; // Return error code.
+    }
+
+    // adds file to data block of parent
+    if (dir_add(currentInode, i, arr[n - 1]) == -1) // Add file to parent directory.
+    {
+        free_file(i); // Give the inode and blocks back.
+        return -1; // Return error code.
+    }
+    update_fs(); // Update the file system.
+    return 0; // Return success code.
+}
+
+/**
+ * @brief deletes a file
+ *
+ * @param path
+ * @return int
+ */
+int DL(char *path)
+{
+    char temp[PATH_MAXLEN], *arr[PATH_MAXDEPTH];
+
+    // splits the path by /
+    int n = split(path, temp, arr);
+    if (n <= 0)
+    {
+        if (n == 0)
+        {
+            printf("error: Cannot handle directories!\n"); // Path names the root directory.
+        }
+        return -1; // Return error code.
+    }
+
+    // traverse the path
+    int currentInode = walk(arr, n - 1);
+    if (currentInode == -1)
+    {
+        return -1; // Return error code.
+    }
+    int item = dir_find(currentInode, arr[n - 1]); // Find target item.
+
+    // check if target item exists and is a file
+    if (item == -1)
+    {
+        printf("error: The file does not exist!\n"); // File not found.
+        return -1; // Return error code.
+    }
+    else if (inode_dir(item))
+    {
+        printf("error: Cannot handle directories!\n"); // Cannot handle directories.
+        return -1; // Return error code.
+    }
+
+    // free up data blocks and inode used by file
+    free_file(item);
+    dir_remove(currentInode, item); // Delete file from parent directory.
+    update_fs(); // Update the file system.
+
+    return 0; // Return success code.
+}
+
+/**
+ * @brief copies a file
+ *
+ * @param srcpath
+ * @param dstpath
+ * @return int
+ */
+int CP(char *srcpath, char *dstpath)
+{
+    int i = 0, n = 0;
+    char *arr[PATH_MAXDEPTH]; // Array to store path components.
+    char temp[PATH_MAXLEN];
+
+    // split the source path by /
+    n = split(srcpath, temp, arr);
+    if (n < 0)
+    {
+        return -1; // Return error code.
+    }
+
+    // traverse the source path
+    int currentInode = walk(arr, n == 0 ? 0 : n - 1);
+    if (currentInode == -1)
+    {
+        return -1; // Return error code.
+    }
+    int item = n == 0 ? -1 : dir_find(currentInode, arr[n - 1]); // Find source file.
+
+    // check if source file exists
+    if (item == -1)
+    {
+        printf("error: File %s not found!\n", srcpath); // Source file not found.
+        return -1; // Return error code.
+    }
+    else if (inode_dir(item))
+    {
+        printf("error: Cannot handle directories!\n"); // Cannot handle directories.
+        return -1; // Return error code.
+    }
+
+    // split the destination path by /
+    n = split(dstpath, temp, arr);
+    if (n <= 0)
+    {
+        if (n == 0)
+        {
+            printf("error: The file already exists!\n"); // Path names the root directory.
+        }
+        return -1; // Return error code.
+    }
+
+    // traverse the destination path
+    currentInode = walk(arr, n - 1);
+    if (currentInode == -1)
+    {
+        return -1; // Return error code.
+    }
+
+    // check if target file already exists
+    if (dir_find(currentInode, arr[n - 1]) != -1)
+    {
+        printf("error: The file already exists!\n"); // File already exists.
+        return -1; // Return error code.
+    }
+
+    // finds a free inode near the parent directory and reserves blocks, or shares the source's blocks
+    i = dedup ? share_file(currentInode, item) : alloc_file(currentInode, inodeSize[item], item);
+    if (i == -1)
+    {
+        return -1; // Return error code.
+    }
+
+    // add the file to parent data table
+    if (dir_add(currentInode, i, arr[n - 1]) == -1) // Add file to parent directory.
+    {
+        free_file(i); // Give the inode and blocks back.
+        return -1; // Return error code.
+    }
+    update_fs(); // Update the file system.
+    return 0; // Return success code.
+}
+
+/**
+ * @brief moves a file
+ *
+ * @param srcpath
+ * @param dstpath
+ * @return int
+ */
+int MV(char *srcpath, char *dstpath)
+{
+    int n = 0;
+    char *arr[PATH_MAXDEPTH];
+    char temp[PATH_MAXLEN], name[FILENAME_MAXLEN];
+
+    // split source path by /
+    n = split(srcpath, temp, arr);
+    if (n < 0)
+    {
+        return -1; // Return error code.
+    }
+
+    // traverse source path
+    int srcDirInode = walk(arr, n == 0 ? 0 : n - 1);
+    if (srcDirInode == -1)
+    {
+        return -1; // Return error code.
+    }
+    int item = n == 0 ? -1 : dir_find(srcDirInode, arr[n - 1]); // Find source file.
+
+    // check if source file exists
+    if (item == -1)
+    {
+        printf("error: File %s does not exist!\n", srcpath); // Source file not found.
+        return -1; // Return error code.
+    }
+    else if (inode_dir(item))
+    {
+        printf("error: Cannot handle directories!\n"); // Cannot handle directories.
+        return -1; // Return error code.
+    }
+    strcpy(name, arr[n - 1]); // Keep the source name, temp is reused below.
+
+    // split the destination path by /
+    n = split(dstpath, temp, arr);
+    if (n <= 0)
+    {
+        if (n == 0)
+        {
+            printf("error: The file already exists!\n"); // Path names the root directory.
+        }
+        return -1; // Return error code.
+    }
+
+    // traverse the destination path
+    int currentInode = walk(arr, n - 1);
+    if (currentInode == -1)
+    {
+        return -1; // Return error code.
+    }
+
+    // checks if destination file already exists
+    if (dir_find(currentInode, name) != -1)
+    {
+        printf("error: The file already exists!\n"); // File already exists.
+        return -1; // Return error code.
+    }
+
+    // A move between shards changes two image files; log it first, and write both right away
+    int across = shard_of(group_of(srcDirInode)) != shard_of(group_of(currentInode));
+    if (across && intent_write(srcDirInode, item, currentInode, arr[n - 1]) == -1)
+    {
+        return -1; // Return error code.
+    }
+
+    // update the inode for existing file
+    if (dir_add(currentInode, item, arr[n - 1]) == -1) // Add file to destination directory.
+    {
+        if (across)
+        {
+            unlink("myfs.txt.intent"); // Nothing moved.
+            intentPending = 0;
+        }
+        return -1; // Return error code.
+    }
+    dir_remove(srcDirInode, item); // Delete file from source directory.
+    if (across)
+    {
+        return sync_fs(); // Commit point of the move.
+    }
+    update_fs(); // Update the file system.
+    return 0; // Return success code.
+}
+
+/**
+ * @brief creates a directory
+ *
+ * @param path
+ * @return int
+ */
+int CD(char *path)
+{
+    int i = 0;
+    char *arr[PATH_MAXDEPTH];
+    char temp[PATH_MAXLEN];
+
+    // Split the path by /
+    int n = split(path, temp, arr);
+    if (n <= 0)
+    {
+        if (n == 0)
+        {
+            printf("error: Directory already exists!\n"); // Path names the root directory.
+        }
+        return -1; // Return error code.
+    }
+    int currentInode = 0; // Start from root inode.
+    int item = -1;
+
+    // Traverse the path
+    for (i = 0; i < n - 1; ++i)
+    {
+        item = dir_find(currentInode, arr[i]); // Find directory in path.
+        if (item == -1 || !inode_dir(item))
+        {
+            printf("error: %s not in directory %s!\n", arr[i], i == 0 ? "/" : arr[i - 1]); // Directory not found in current directory.
+            return -1; // Return error code.
+        }
+        currentInode = item; // Update current inode.
+    }
+
+    // Check if the target directory already exists
+    if (dir_find(currentInode, arr[n - 1]) != -1)
+    {
+        printf("error: Directory already exists!\n"); // Directory already exists.
+        return -1; // Return error code.
+    }
+
+    // Find an unused inode, spreading top level directories across groups
+    i = alloc_inode(currentInode, 1);
+    if (i == -1)
+    {
+        return -1; // Return error code.
+    }
+
+    // A new directory holds only '.' and '..', which fit inline without a data block
+    inline_init(i, currentInode);
+    if (dir_add(currentInode, i, arr[n - 1]) == -1) // Add directory to parent.
+    {
+        free_inode(i); // Give the inode back.
+        return -1; // Return error code.
+    }
+    update_fs(); // Update the file system.
+
+    return 0; // Return success code.
+}
+
+/**
+ * @brief returns the number of threads a parallel pass uses, one per online CPU
+ *
+ * @return int
+ */
+int pool_threads()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : cpus > POOL_MAXTHREADS ? POOL_MAXTHREADS : cpus;
+}
+
+/**
+ * @brief queues a task on a worker's own deque
+ *
+ * @param w
+ * @param inode
+ * @param depth
+ * @param path
+ */
+void pool_push(worker *w, int inode, int depth, char *path)
+{
+    count(&w->pool->pending, 1); // Counted before it can be stolen.
+    pthread_mutex_lock(&w->lock);
+    if (w->tail == w->cap)
+    {
+        if (w->head > 0)
+        {
+            // Reuse the room stolen tasks left at the front
+            memmove(w->tasks, w->tasks + w->head, (w->tail - w->head) * sizeof(walkTask));
+            w->tail -= w->head;
+            w->head = 0;
+        }
+        else
+        {
+            w->cap = w->cap ? 2 * w->cap : 64;
+            w->tasks = realloc(w->tasks, w->cap * sizeof(walkTask));
+        }
+    }
+    w->tasks[w->tail].inode = inode;
+    w->tasks[w->tail].depth = depth;
+    w->tasks[w->tail].path = path;
+    ++w->tail;
+    pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * @brief takes a task, newest from the worker's own deque, oldest from a victim's
+ *
+ * @param w
+ * @param victim
+ * @param task
+ * @return int
+ */
+int pool_take(worker *w, worker *victim, walkTask *task)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->head < victim->tail)
+    {
+        // Stolen tasks are the shallowest, so a thief takes a large subtree away
+        *task = victim == w ? victim->tasks[--victim->tail] : victim->tasks[victim->head++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&victim->lock);
+    return found;
+}
+
+/**
+ * @brief runs one worker until the traversal has no tasks left
+ *
+ * @param arg
+ * @return void*
+ */
+void *pool_work(void *arg)
+{
+    worker *w = arg;
+    pool *p = w->pool;
+    walkTask task;
+
+    while (__atomic_load_n(&p->pending, __ATOMIC_ACQUIRE) > 0)
+    {
+        int found = pool_take(w, w, &task);
+        for (int i = 1; !found && i < p->count; ++i)
+        {
+            found = pool_take(w, &p->workers[(w->id + i) % p->count], &task); // Steal.
+        }
+        if (!found)
+        {
+            sched_yield(); // Others still hold work that may spawn more.
+            continue;
+        }
+        p->visit(w, &task);
+        free(task.path);
+        count(&p->pending, -1);
+    }
+    return NULL;
+}
+
+/**
+ * @brief visits the tree below a directory on a pool of threads, returns the worker count
+ *
+ * @param p
+ * @param inode
+ * @param path
+ * @return int
+ */
+int pool_run(pool *p, int inode, char *path)
+{
+    pthread_t threads[POOL_MAXTHREADS];
+
+    p->count = pool_threads();
+    p->pending = 0;
+    for (int i = 0; i < p->count; ++i)
+    {
+        p->workers[i].pool = p;
+        p->workers[i].id = i;
+        pthread_mutex_init(&p->workers[i].lock, NULL);
+    }
+    pool_push(&p->workers[0], inode, 0, path != NULL ? strdup(path) : NULL);
+
+    for (int i = 1; i < p->count; ++i)
+    {
+        if (pthread_create(&threads[i], NULL, pool_work, &p->workers[i]) != 0)
+        {
+            p->count = i; // Carry on with the workers started so far.
+            break;
+        }
+    }
+    pool_work(&p->workers[0]); // The caller is worker 0.
+    for (int i = 1; i < p->count; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < p->count; ++i)
+    {
+        free(p->workers[i].tasks);
+        pthread_mutex_destroy(&p->workers[i].lock);
+    }
+    return p->count;
+}
+
+/**
+ * @brief frees the inodes and blocks of a batch, taking each group lock once
+ *
+ * @param b
+ */
+void dd_flush(ddBatch *b)
+{
+    int freedInodes[GROUP_COUNT] = {0}, freedBlocks[GROUP_COUNT] = {0};
+    int files = 0, dirs = 0, unshared = 0;
+
+    PROBE(batch_free, b->inodeCount, b->blockCount);
+    for (int i = 0; i < b->inodeCount; ++i)
+    {
+        if (inode_dir(b->inodes[i]))
+        {
+            ++dirs;
+        }
+        else
+        {
+            ++files;
+        }
+        ++freedInodes[group_of(b->inodes[i])];
+    }
+
+    for (int g = 0; g < GROUP_COUNT; ++g)
+    {
+        pthread_mutex_lock(&groups[g].lock);
+        for (int i = 0; i < b->inodeCount; ++i)
+        {
+            int inode = b->inodes[i];
+            if (group_of(inode) == g)
+            {
+                set_bit(inodeUsed, inode, 0); // Mark inode as unused.
+                inodeSize[inode] = 0;
+                inodeFlags[inode] = 0;
+            }
+        }
+        for (int i = 0; i < b->blockCount; ++i)
+        {
+            int j = b->blocks[i], k = j % GROUP_BLOCKS;
+            if (j / GROUP_BLOCKS != g)
+            {
+                continue;
+            }
+            if (blockRefs[j] > 0)
+            {
+                --blockRefs[j]; // Still in use by another file.
+                ++unshared;
+            }
+            else
+            {
+                groups[g].bitmap[k / 64] &= ~(1ULL << (k % 64)); // Mark data block as unused.
+                ++freedBlocks[g];
+            }
+        }
+        groups[g].freeInodes += freedInodes[g];
+        groups[g].freeBlocks += freedBlocks[g];
+        pthread_mutex_unlock(&groups[g].lock);
+        if (freedInodes[g] > 0 || freedBlocks[g] > 0)
+        {
+            mark_dirty(g);
+        }
+
+        count(&stats.freeInodes, freedInodes[g]);
+        count(&stats.freeBlocks, freedBlocks[g]);
+    }
+    count(&stats.files, -files);
+    count(&stats.dirs, -dirs);
+    count(&stats.sharedRefs, -unshared);
+    b->inodeCount = b->blockCount = 0;
+}
+
+/**
+ * @brief queues a block for release, flushing a full batch
+ *
+ * @param b
+ * @param block
+ */
+void dd_block(ddBatch *b, int block)
+{
+    if (b->blockCount == DD_BATCH)
+    {
+        dd_flush(b);
+    }
+    b->blocks[b->blockCount++] = block;
+}
+
+/**
+ * @brief queues an inode for release, flushing a full batch
+ *
+ * @param b
+ * @param inode
+ */
+void dd_inode(ddBatch *b, int inode)
+{
+    if (b->inodeCount == DD_BATCH)
+    {
+        dd_flush(b);
+    }
+    b->inodes[b->inodeCount++] = inode;
+}
+
+/**
+ * @brief releases one directory with its files and queues its subdirectories
+ *
+ * @param w
+ * @param task
+ */
+void dd_visit(worker *w, walkTask *task)
+{
+    ddBatch *b = w->local;
+    diriter it;
+
+    dir_open(&it, task->inode);
+    while (dir_next(&it))
+    {
+        if (strcmp(it.name, ".") == 0 || strcmp(it.name, "..") == 0)
+        {
+            continue;
+        }
+        if (inode_dir(it.inode))
+        {
+            pool_push(w, it.inode, task->depth + 1, NULL); // Subtrees are freed by whichever worker takes them.
+            continue;
+        }
+        for (int i = 0; i < inodeSize[it.inode]; ++i)
+        {
+            int j = inodeBlocks[it.inode].blockptrs[i];
+            if (j == BLOCK_DELAYED)
+            {
+                count(&stats.reservedBlocks, -1); // Drop the reservation.
+            }
+            else if (j != BLOCK_HOLE)
+            {
+                dd_block(b, j);
+            }
+        }
+        dd_inode(b, it.inode);
+    }
+
+    // Entries were read above; the directory goes once its children are known
+    int j = dir_drop(task->inode);
+    if (j != -1)
+    {
+        dd_block(b, j);
+    }
+    dd_inode(b, task->inode);
+}
+
+/**
+ * @brief deletes a directory and everything below it
+ *
+ * @param path
+ * @return int
+ */
+int DD(char *path)
+{
+    // Initialize variables
+    char *arr[PATH_MAXDEPTH]; // Array to store split path components
+    char temp[PATH_MAXLEN];
+
+    // Split the path by /
+    int n = split(path, temp, arr);
+    if (n < 0)
+    {
+        return -1;
+    }
+
+    // Check if trying to delete root directory
+    if (n == 0)
+    {
+        printf("error: Cannot delete root directory!\n");
+        return -1;
+    }
+
+    // Traverse the given path
+    int parentInode = walk(arr, n - 1);
+    if (parentInode == -1)
+    {
+        return -1;
+    }
+
+    int item = dir_find(parentInode, arr[n - 1]);
+
+    // Check if target directory exists
+    if (item == -1)
+    {
+        printf("error: The directory does not exist!\n");
+        return -1;
+    }
+    else if (!inode_dir(item))
+    {
+        printf("error: Cannot handle files!\n");
+        return 0;
+    }
+
+    pool *p = calloc(1, sizeof(pool));
+    ddBatch *batches = malloc(POOL_MAXTHREADS * sizeof(ddBatch));
+    if (p == NULL || batches == NULL)
+    {
+        free(p);
+        free(batches);
+        printf("error: Out of memory!\n");
+        return -1;
+    }
+    for (int i = 0; i < POOL_MAXTHREADS; ++i)
+    {
+        batches[i].inodeCount = batches[i].blockCount = 0;
+        p->workers[i].local = &batches[i];
+    }
+    p->visit = dd_visit;
+
+    // Detach the subtree, then free it by inode with no further path lookups
+    dir_remove(parentInode, item);
+    pool_run(p, item, NULL);
+    for (int i = 0; i < POOL_MAXTHREADS; ++i)
+    {
+        dd_flush(&batches[i]);
+    }
+
+    free(batches);
+    free(p);
+    update_fs(); // One commit for the whole subtree.
+    return 0; // Return success code.
+}
+
+/**
+ * @brief lists files and directories
+ *
+ * @param path
+ * @return int
+ */
+int LL(char *path)
+{
+    // Initialize variables
+    char *arr[PATH_MAXDEPTH]; // Array to store split path components
+    char temp[PATH_MAXLEN];
+
+    // Split the path by /
+    int n = split(path, temp, arr);
+    if (n < 0)
+    {
+        return -1;
+    }
+
+    int size = 0;
+
+    // Traverse the path, handling the root directory
+    int currentInode = walk(arr, n);
+    if (currentInode == -1)
+    {
+        return -1;
+    }
+    char childPath[PATH_MAXLEN];
+    diriter it;
+
+    // Loop through items in directory
+    dir_open(&it, currentInode);
+    while (dir_next(&it))
+    {
+        if (strcmp(it.name, ".") != 0 && strcmp(it.name, "..") != 0)
+        {
+            snprintf(childPath, sizeof(childPath), "%s/%s",
+                     strcmp(path, "/") == 0 ? "" : path, it.name);
+
+            // Recursive call for subdirectories
+            if (inode_dir(it.inode))
+            {
+                size += LL(childPath);
+            }
+            else
+            {
+                printf("type: file\npath: %s\nsize: %d\n\n", childPath,
+                       inodeSize[it.inode]);
+                size += inodeSize[it.inode];
+            }
+        }
+    }
+    ++size; // Add size of directory
+    printf("type: directory\npath: %s\nsize: %d\n\n", path, size);
+    return size;
+}
+
+/**
+ * @brief orders names for qsort()
+ *
+ * @param a
+ * @param b
+ * @return int
+ */
+int namecmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * @brief prints one entry of a listing
+ *
+ * @param path
+ * @param name
+ * @param inode
+ */
+void ls_entry(char *path, char *name, int inode)
+{
+    printf("type: %s\npath: %s/%s\nsize: %d\n\n", inode_dir(inode) ? "directory" : "file",
+           strcmp(path, "/") == 0 ? "" : path, name, inodeSize[inode]);
+}
+
+/**
+ * @brief lists a page of a directory in name order, returns the number of entries listed
+ *
+ * The page is given as LIMIT or LIMIT:AFTER, listing at most LIMIT entries
+ * (all if 0) whose names sort after AFTER. When more entries follow, the
+ * last name is printed as the cursor of the next page.
+ *
+ * @param path
+ * @param page
+ * @return int
+ */
+int LS(char *path, char *page)
+{
+    char *arr[PATH_MAXDEPTH]; // Array to store split path components
+    char temp[PATH_MAXLEN];
+    char *after = strchr(page, ':');
+    int limit = atoi(page), listed = 0;
+    char *last = NULL;
+
+    after = after == NULL ? "" : after + 1;
+    if (limit <= 0)
+    {
+        limit = INODE_COUNT; // No directory holds more.
+    }
+
+    int n = split(path, temp, arr);
+    if (n < 0)
+    {
+        return -1;
+    }
+    int dirInode = walk(arr, n);
+    if (dirInode == -1)
+    {
+        return -1;
+    }
+
+    if (inodeFlags[dirInode] & INODE_INLINE)
+    {
+        // An inline directory has a few entries; sort them on the spot
+        char *names[INLINE_MAXLEN];
+        int count = 0;
+        diriter it;
+        dir_open(&it, dirInode);
+        while (dir_next(&it))
+        {
+            if (strcmp(it.name, ".") != 0 && strcmp(it.name, "..") != 0 && strcmp(it.name, after) > 0)
+            {
+                names[count++] = it.name;
+            }
+        }
+        qsort(names, count, sizeof(char *), namecmp);
+        for (int i = 0; i < count && listed < limit; ++i)
+        {
+            ls_entry(path, names[i], dir_find(dirInode, names[i]));
+            last = names[i];
+            ++listed;
+        }
+        if (listed < count)
+        {
+            printf("next: %s\n\n", last);
+        }
+        return listed;
+    }
+
+    // Seek in the name index, then follow the leaves; '.' and '..' are left out
+    directory *dir = dir_of(dirInode);
+    if (dir == NULL)
+    {
+        return -1; // Return error code.
+    }
+    btleaf *leaf = bt_leaf(dir, after);
+    int i = leaf == NULL ? 0 : bt_search(dir, leaf, after, 1);
+    for (; leaf != NULL; leaf = leaf->next, i = 0)
+    {
+        for (; i < leaf->hdr.count; ++i)
+        {
+            dirent *item = &dir->ents[leaf->items[i]];
+            char *name = entryname(dir, item);
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            {
+                continue;
+            }
+            if (listed == limit)
+            {
+                printf("next: %s\n\n", last);
+                return listed;
+            }
+            ls_entry(path, name, item->inode);
+            last = name;
+            ++listed;
+        }
+    }
+    return listed;
+}
+
+/**
+ * @brief counts an inconsistency, printing the first FSCK_MAXREPORT of them
+ *
+ * @param st
+ * @param format
+ * @param ...
+ */
+void fsck_report(fsckState *st, const char *format, ...)
+{
+    va_list args;
+
+    if (count(&st->problems, 1) < FSCK_MAXREPORT)
+    {
+        char buf[FILENAME_MAXLEN + 64];
+        va_start(args, format);
+        vsnprintf(buf, sizeof(buf), format, args);
+        va_end(args);
+        printf("fsck: %s\n", buf); // One call, so lines of different threads do not mix.
+    }
+}
+
+/**
+ * @brief queues a repair found while walking the tree
+ *
+ * @param st
+ * @param dir
+ * @param inode
+ * @param parent
+ */
+void fsck_fix(fsckState *st, int dir, int inode, int parent)
+{
+    pthread_mutex_lock(&st->lock);
+    if (st->fixCount == st->fixCap)
+    {
+        st->fixCap = st->fixCap == 0 ? 64 : st->fixCap * 2;
+        st->fixes = (fsckFix *)realloc(st->fixes, st->fixCap * sizeof(fsckFix));
+    }
+    st->fixes[st->fixCount].dir = dir;
+    st->fixes[st->fixCount].inode = inode;
+    st->fixes[st->fixCount].parent = parent;
+    ++st->fixCount;
+    pthread_mutex_unlock(&st->lock);
+}
+
+/**
+ * @brief returns the bytes of an inline directory that hold whole entries
+ *
+ * @param dirInode
+ * @return int
+ */
+int fsck_inline(int dirInode)
+{
+    unsigned char *inl = inodeBlocks[dirInode].inl;
+    int end = inl[4] > INLINE_MAXLEN - 5 ? INLINE_MAXLEN : 5 + inl[4], off = 5;
+
+    while (off + (int)sizeof(int) < end)
+    {
+        unsigned char *nul = memchr(inl + off + sizeof(int), '\0', end - off - sizeof(int));
+        if (nul == NULL || nul == inl + off + sizeof(int))
+        {
+            break; // Unterminated or empty name.
+        }
+        off = nul + 1 - inl;
+    }
+    return off - 5;
+}
+
+/**
+ * @brief checks the inodes of a range and counts the block references they hold
+ *
+ * @param arg
+ * @return void*
+ */
+void *fsck_inodes(void *arg)
+{
+    fsckRange *r = arg;
+    fsckState *st = r->st;
+
+    for (int i = r->lo; i < r->hi; ++i)
+    {
+        if (!inode_used(i))
+        {
+            continue;
+        }
+        int *ptrs = inodeBlocks[i].blockptrs;
+        if (inode_dir(i) && (inodeFlags[i] & INODE_INLINE))
+        {
+            int used = fsck_inline(i);
+            if (used != inodeBlocks[i].inl[4])
+            {
+                fsck_report(st, "directory %d: inline entries are damaged", i);
+                set_bit(st->broken, i, 1);
+            }
+        }
+        else if (inode_dir(i))
+        {
+            if (ptrs[0] < 0 || ptrs[0] >= BLOCK_COUNT)
+            {
+                fsck_report(st, "directory %d: bad block pointer %d", i, ptrs[0]);
+                set_bit(st->broken, i, 1);
+            }
+            else
+            {
+                count(&st->dirRefs[ptrs[0]], 1);
+            }
+        }
+        else if (inodeSize[i] < 0 || inodeSize[i] > BLOCK_PTRS)
+        {
+            fsck_report(st, "file %d: bad size %d", i, inodeSize[i]);
+        }
+        else
+        {
+            for (int k = 0; k < inodeSize[i]; ++k)
+            {
+                if (ptrs[k] >= 0 && ptrs[k] < BLOCK_COUNT)
+                {
+                    count(&st->fileRefs[ptrs[k]], 1);
+                }
+                else if (ptrs[k] != BLOCK_HOLE)
+                {
+                    fsck_report(st, "file %d: bad block pointer %d", i, ptrs[k]);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief checks the block bitmap of a range against the references found
+ *
+ * @param arg
+ * @return void*
+ */
+void *fsck_blocks(void *arg)
+{
+    fsckRange *r = arg;
+    fsckState *st = r->st;
+
+    for (int j = r->lo; j < r->hi; ++j)
+    {
+        int refs = st->fileRefs[j] + st->dirRefs[j];
+        if (refs > 0 && !block_used(j))
+        {
+            fsck_report(st, "block %d: in use but marked free", j);
+        }
+        else if (refs == 0 && block_used(j))
+        {
+            fsck_report(st, "block %d: marked in use but unreferenced", j);
+        }
+        if (st->dirRefs[j] > 0 && refs > 1)
+        {
+            fsck_report(st, "block %d: directory block shared with another inode", j);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief reports the used inodes of a range that the tree does not reach
+ *
+ * @param arg
+ * @return void*
+ */
+void *fsck_orphans(void *arg)
+{
+    fsckRange *r = arg;
+
+    for (int i = r->lo; i < r->hi; ++i)
+    {
+        if (inode_used(i) && !test_bit(r->st->reached, i))
+        {
+            fsck_report(r->st, "inode %d: orphan, in no directory", i);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief runs a pass over [0, n) split in contiguous ranges, one per thread
+ *
+ * @param st
+ * @param n
+ * @param pass
+ */
+void fsck_parallel(fsckState *st, int n, void *(*pass)(void *))
+{
+    pthread_t threads[POOL_MAXTHREADS];
+    fsckRange ranges[POOL_MAXTHREADS];
+    int count = pool_threads(), started = 1;
+
+    for (int t = 0; t < count; ++t)
+    {
+        ranges[t].st = st;
+        ranges[t].lo = (long long)n * t / count;
+        ranges[t].hi = (long long)n * (t + 1) / count;
+    }
+    for (; started < count; ++started)
+    {
+        if (pthread_create(&threads[started], NULL, pass, &ranges[started]) != 0)
+        {
+            break;
+        }
+    }
+    for (int t = started; t < count; ++t)
+    {
+        pass(&ranges[t]); // Ranges no thread took, done here.
+    }
+    pass(&ranges[0]);
+    for (int t = 1; t < started; ++t)
+    {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+/**
+ * @brief checks the entries of one directory and queues its subdirectories
+ *
+ * @param w
+ * @param task
+ */
+void fsck_visit(worker *w, walkTask *task)
+{
+    fsckState *st = w->pool->arg;
+    int dirInode = task->inode, parentInode = st->parent[dirInode], dot = 0, dotdot = 0;
+    diriter it;
+
+    if (test_bit(st->broken, dirInode))
+    {
+        return; // Entries cannot be trusted; reported already.
+    }
+    dir_open(&it, dirInode);
+    while (dir_next(&it))
+    {
+        if (strcmp(it.name, ".") == 0 || strcmp(it.name, "..") == 0)
+        {
+            int want = it.name[1] == '\0' ? dirInode : parentInode;
+            ++*(it.name[1] == '\0' ? &dot : &dotdot);
+            if (it.inode != want)
+            {
+                fsck_report(st, "directory %d: '%s' is %d, not %d", dirInode, it.name, it.inode, want);
+                fsck_fix(st, dirInode, want, it.name[1] == '\0' ? 2 : 1);
+            }
+            continue;
+        }
+        if (it.inode < 0 || it.inode >= INODE_COUNT || !inode_used(it.inode))
+        {
+            fsck_report(st, "directory %d: entry %s names unused inode %d", dirInode, it.name, it.inode);
+            fsck_fix(st, dirInode, it.inode, 0);
+            continue;
+        }
+        unsigned long long bit = 1ULL << (it.inode % 64);
+        if (__atomic_fetch_or(&st->reached[it.inode / 64], bit, __ATOMIC_RELAXED) & bit)
+        {
+            fsck_report(st, "directory %d: entry %s links inode %d a second time", dirInode, it.name, it.inode);
+            fsck_fix(st, dirInode, it.inode, 0);
+            continue;
+        }
+        st->parent[it.inode] = dirInode;
+        if (inode_dir(it.inode))
+        {
+            pool_push(w, it.inode, task->depth + 1, NULL);
+        }
+    }
+
+    // Block directories list '.' and '..' (the root no '..'); inline ones imply them
+    if (!(inodeFlags[dirInode] & INODE_INLINE) && (dot != 1 || dotdot != (dirInode != 0)))
+    {
+        fsck_report(st, "directory %d: '.' or '..' missing or repeated", dirInode);
+        fsck_fix(st, dirInode, dirInode, 2);
+        if (dirInode != 0)
+        {
+            fsck_fix(st, dirInode, parentInode, 1);
+        }
+    }
+}
+
+/**
+ * @brief points the '.' (which 2) or '..' (which 1) entry of a directory at an inode
+ *
+ * @param dirInode
+ * @param inode
+ * @param which
+ */
+void fsck_link(int dirInode, int inode, int which)
+{
+    char *name = which == 2 ? "." : "..";
+    mark_dirty(group_of(dirInode));
+
+    if (inodeFlags[dirInode] & INODE_INLINE)
+    {
+        if (which == 1)
+        {
+            memcpy(inodeBlocks[dirInode].inl, &inode, sizeof(int)); // '.' is implied.
+        }
+        return;
+    }
+    directory *dir = dir_of(dirInode);
+    dirent *item;
+    if (dir == NULL)
+    {
+        return; // Left for the next --fsck, which loads it in full.
+    }
+    while ((item = find(dir, name)) != NULL)
+    {
+        delete (dir, item->inode); // Drop every copy, then add one.
+    }
+    push(dir, inode, name);
+}
+
+/**
+ * @brief rebuilds bitmaps and counters from the block pointers of the inodes in use
+ */
+void fsck_rebuild()
+{
+    init_groups(); // Empty bitmaps, full counters.
+    memset(shardDirty, 1, shardCount); // Every group is rewritten.
+    for (int i = 0; i < INODE_COUNT; ++i)
+    {
+        if (!inode_used(i))
+        {
+            continue;
+        }
+        --groups[group_of(i)].freeInodes;
+        --stats.freeInodes;
+        ++*(inode_dir(i) ? &stats.dirs : &stats.files);
+        stats.inlineDirs += (inodeFlags[i] & INODE_INLINE) != 0;
+
+        int n = inode_dir(i) ? !(inodeFlags[i] & INODE_INLINE) : inodeSize[i];
+        for (int k = 0; k < n; ++k)
+        {
+            int j = inodeBlocks[i].blockptrs[k];
+            if (j >= 0 && !block_used(j))
+            {
+                group *g = &groups[j / GROUP_BLOCKS];
+                g->bitmap[j % GROUP_BLOCKS / 64] |= 1ULL << (j % GROUP_BLOCKS % 64);
+                --g->freeBlocks;
+                --stats.freeBlocks;
+            }
+        }
+    }
+    count_refs();
+}
+
+/**
+ * @brief applies the repairs FSCK found
+ *
+ * @param st
+ */
+void fsck_repair(fsckState *st)
+{
+    // Damaged directories start over empty; what they held turns up as orphans
+    for (int i = 0; i < INODE_COUNT; ++i)
+    {
+        if (test_bit(st->broken, i))
+        {
+            inline_init(i, i == 0 ? -1 : st->parent[i]);
+        }
+    }
+
+    for (int f = 0; f < st->fixCount; ++f)
+    {
+        fsckFix *x = &st->fixes[f];
+        if (x->parent)
+        {
+            fsck_link(x->dir, x->inode, x->parent);
+        }
+        else
+        {
+            dir_remove(x->dir, x->inode);
+        }
+    }
+
+    // Bad pointers become holes, directory blocks are taken back from files
+    for (int i = 0; i < INODE_COUNT; ++i)
+    {
+        if (!inode_used(i))
+        {
+            continue;
+        }
+        if (!test_bit(st->reached, i))
+        {
+            if (inode_dir(i) && !(inodeFlags[i] & INODE_INLINE) && !test_bit(st->broken, i) &&
+                st->dirRefs[inodeBlocks[i].blockptrs[0]] == 1)
+            {
+                dir_drop(i); // Its block is released by the rebuild.
+            }
+            inodeFlags[i] = 0;
+            set_bit(inodeUsed, i, 0); // Orphans are released.
+            continue;
+        }
+        if (!inode_dir(i))
+        {
+            if (inodeSize[i] < 0 || inodeSize[i] > BLOCK_PTRS)
+            {
+                inodeSize[i] = 0;
+            }
+            for (int k = 0; k < inodeSize[i]; ++k)
+            {
+                int j = inodeBlocks[i].blockptrs[k];
+                if (j < BLOCK_HOLE || j >= BLOCK_COUNT || (j >= 0 && st->dirRefs[j] > 0))
+                {
+                    inodeBlocks[i].blockptrs[k] = BLOCK_HOLE;
+                }
+            }
+        }
+    }
+    fsck_rebuild();
+}
+
+/**
+ * @brief checks the image, repairing it if mode is "repair", returns the number of problems found
+ *
+ * Inode ranges are checked on one thread each, then the tree is walked on
+ * the traversal pool for entries, '.' and '..' links and reachability,
+ * and finally orphans are looked for by inode range again. Run with
+ * --fsck, the image was loaded leaving out its bad records, which count
+ * as problems too.
+ *
+ * @param mode
+ * @return int
+ */
+int FSCK(char *mode)
+{
+    fsckState *st = (fsckState *)calloc(1, sizeof(fsckState));
+    pool *p = (pool *)calloc(1, sizeof(pool));
+    int problems;
+
+    if (st == NULL || p == NULL)
+    {
+        free(st);
+        free(p);
+        printf("error: Out of memory!\n");
+        return -1;
+    }
+    st->repair = strcmp(mode, "repair") == 0;
+
+    // A directory that could not be read back is checked from a full load of the image
+    if (memchr(shardDamaged, 1, shardCount) != NULL)
+    {
+        int tolerant = fsckLoad;
+        fsckLoad = 1;
+        problems = load_fs(0);
+        fsckLoad = tolerant;
+        if (problems == -1)
+        {
+            free(st);
+            free(p);
+            return -1;
+        }
+    }
+    st->problems = loadProblems; // Records the load left out, reported already.
+    loadProblems = 0;
+    pthread_mutex_init(&st->lock, NULL);
+    assign_delayed(); // Check blocks where they will be written.
+
+    fsck_parallel(st, INODE_COUNT, fsck_inodes);
+    fsck_parallel(st, BLOCK_COUNT, fsck_blocks);
+    for (int g = 0; g < GROUP_COUNT; ++g)
+    {
+        int inodes = 0, blocks = 0;
+        for (int i = g * GROUP_INODES; i < (g + 1) * GROUP_INODES; ++i)
+        {
+            inodes += inode_used(i);
+        }
+        for (int j = g * GROUP_BLOCKS; j < (g + 1) * GROUP_BLOCKS; ++j)
+        {
+            blocks += block_used(j);
+        }
+        if (groups[g].freeInodes != GROUP_INODES - inodes || groups[g].freeBlocks != GROUP_BLOCKS - blocks)
+        {
+            fsck_report(st, "group %d: free counters are %d and %d, not %d and %d", g,
+                        groups[g].freeInodes, groups[g].freeBlocks, GROUP_INODES - inodes, GROUP_BLOCKS - blocks);
+        }
+    }
+
+    if (!inode_used(0) || !inode_dir(0))
+    {
+        fsck_report(st, "root directory is missing");
+    }
+    else
+    {
+        set_bit(st->reached, 0, 1);
+        st->parent[0] = -1;
+        p->visit = fsck_visit;
+        p->arg = st;
+        pool_run(p, 0, NULL);
+        fsck_parallel(st, INODE_COUNT, fsck_orphans);
+    }
+
+    problems = st->problems;
+    if (st->repair && problems > 0 && inode_used(0) && inode_dir(0))
+    {
+        fsck_repair(st);
+        update_fs();
+    }
+    printf("fsck: %d problems found%s\n\n", problems, st->repair && problems > 0 ? ", repaired" : "");
+
+    pthread_mutex_destroy(&st->lock);
+    free(st->fixes);
+    free(st);
+    free(p);
+    return problems;
+}
+
+/**
+ * @brief copies the usage counters, without scanning the image
+ *
+ * @param out
+ */
+void statfs_fs(fsstat *out)
+{
+    __atomic_load(&stats.freeInodes, &out->freeInodes, __ATOMIC_RELAXED);
+    __atomic_load(&stats.freeBlocks, &out->freeBlocks, __ATOMIC_RELAXED);
+    __atomic_load(&stats.reservedBlocks, &out->reservedBlocks, __ATOMIC_RELAXED);
+    __atomic_load(&stats.sharedRefs, &out->sharedRefs, __ATOMIC_RELAXED);
+    __atomic_load(&stats.files, &out->files, __ATOMIC_RELAXED);
+    __atomic_load(&stats.dirs, &out->dirs, __ATOMIC_RELAXED);
+    __atomic_load(&stats.inlineDirs, &out->inlineDirs, __ATOMIC_RELAXED);
+}
+
+#if CONFIG_CHECKS
+/**
+ * @brief checks the usage counters against the group summaries and bitmaps, returns 0 or -1
+ *
+ * @param op
+ * @return int
+ */
+int check_stats(int op)
+{
+    int freeInodes = 0, freeBlocks = 0, bad = 0;
+
+    for (int g = 0; g < GROUP_COUNT; ++g)
+    {
+        int usedInodes = 0, usedBlocks = 0;
+        for (int i = g * GROUP_INODES; i < (g + 1) * GROUP_INODES; ++i)
+        {
+            usedInodes += inode_used(i);
+        }
+        for (int j = 0; j < GROUP_BLOCKS; ++j)
+        {
+            usedBlocks += test_bit(groups[g].bitmap, j);
+        }
+        bad |= usedInodes != GROUP_INODES - groups[g].freeInodes;
+        bad |= usedBlocks != GROUP_BLOCKS - groups[g].freeBlocks;
+        freeInodes += groups[g].freeInodes;
+        freeBlocks += groups[g].freeBlocks;
+    }
+    if (bad || freeInodes != stats.freeInodes || freeBlocks != stats.freeBlocks)
+    {
+        printf("error: Usage counters out of sync after command %d!\n", op);
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/**
+ * @brief reports inode and block usage
+ *
+ * @return int
+ */
+int DF()
+{
+    fsstat st;
+    statfs_fs(&st);
+
+    int usedBlocks = BLOCK_COUNT - st.freeBlocks;
+    printf("inodes: %d total, %d used, %d free\n", INODE_COUNT,
+           INODE_COUNT - st.freeInodes, st.freeInodes);
+    printf("blocks: %d total, %d used, %d free, %d reserved\n", BLOCK_COUNT,
+           usedBlocks, st.freeBlocks, st.reservedBlocks);
+    printf("files: %d, directories: %d (%d inline)\n", st.files, st.dirs,
+           st.inlineDirs);
+    printf("cache: %lld bytes resident, %d evictions, %d faults\n",
+           __atomic_load_n(&cache.resident, __ATOMIC_RELAXED), cache.evictions, cache.faults);
+    printf("dedup ratio: %.2f\n\n",
+           usedBlocks == 0 ? 1.0 : (double)(usedBlocks + st.sharedRefs) / usedBlocks);
+    return 0;
+}
+
+/**
+ * @brief writes a worker's buffered FIND output to stdout
+ *
+ * @param q
+ * @param out
+ */
+void find_flush(findQuery *q, findOut *out)
+{
+    pthread_mutex_lock(&q->outLock);
+    fwrite(out->data, 1, out->len, stdout);
+    pthread_mutex_unlock(&q->outLock);
+    out->len = 0;
+}
+
+/**
+ * @brief reports an entry if it satisfies the query
+ *
+ * @param q
+ * @param out
+ * @param name
+ * @param path
+ * @param inode
+ */
+void find_match(findQuery *q, findOut *out, char *name, char *path, int inode)
+{
+    int dir = inode_dir(inode);
+
+    if ((q->type == 'f' && dir) || (q->type == 'd' && !dir) ||
+        fnmatch(q->glob, name, 0) != 0)
+    {
+        return;
+    }
+    if (q->sizeOp && (dir || (q->sizeOp == '<' && inodeSize[inode] >= q->size) ||
+                      (q->sizeOp == '=' && inodeSize[inode] != q->size) ||
+                      (q->sizeOp == '>' && inodeSize[inode] <= q->size)))
+    {
+        return; // Sizes are compared for files only.
+    }
+
+    if (out->len > FIND_BUFLEN - PATH_MAXLEN - 64)
+    {
+        find_flush(q, out);
+    }
+    out->len += snprintf(out->data + out->len, FIND_BUFLEN - out->len,
+                         "type: %s\npath: %s\nsize: %d\n\n", dir ? "directory" : "file",
+                         path, inodeSize[inode]);
+    count(&q->matches, 1);
+}
+
+/**
+ * @brief matches the entries of one directory and queues its subdirectories
+ *
+ * @param w
+ * @param task
+ */
+void find_visit(worker *w, walkTask *task)
+{
+    findQuery *q = w->pool->arg;
+    char childPath[PATH_MAXLEN];
+    diriter it;
+
+    dir_open(&it, task->inode);
+    while (dir_next(&it))
+    {
+        if (strcmp(it.name, ".") != 0 && strcmp(it.name, "..") != 0)
+        {
+            snprintf(childPath, sizeof(childPath), "%s/%s",
+                     strcmp(task->path, "/") == 0 ? "" : task->path, it.name);
+            find_match(q, w->local, it.name, childPath, it.inode);
+            if (inode_dir(it.inode) && task->depth + 1 < q->maxDepth)
+            {
+                pool_push(w, it.inode, task->depth + 1, strdup(childPath));
+            }
+        }
+    }
+}
+
+/**
+ * @brief parses a FIND expression of comma separated predicates, returns -1 if invalid
+ *
+ * name=GLOB, type=f|d, size<N, size=N, size>N, depth=N, or a bare GLOB
+ *
+ * @param expr
+ * @param buf
+ * @param q
+ * @return int
+ */
+int find_parse(char *expr, char *buf, findQuery *q)
+{
+    char *save = NULL, *pred;
+
+    q->glob = "*";
+    q->type = 0;
+    q->sizeOp = 0;
+    q->maxDepth = PATH_MAXDEPTH;
+    strncpy(buf, expr, PATH_MAXLEN - 1);
+    buf[PATH_MAXLEN - 1] = '\0';
+
+    for (pred = strtok_r(buf, ",", &save); pred != NULL; pred = strtok_r(NULL, ",", &save))
+    {
+        if (strncmp(pred, "name=", 5) == 0 && pred[5] != '\0')
+        {
+            q->glob = pred + 5;
+        }
+        else if (strcmp(pred, "type=f") == 0 || strcmp(pred, "type=d") == 0)
+        {
+            q->type = pred[5];
+        }
+        else if (strncmp(pred, "size", 4) == 0 && pred[4] != '\0' && strchr("<=>", pred[4]))
+        {
+            q->sizeOp = pred[4];
+            q->size = atoi(pred + 5);
+        }
+        else if (strncmp(pred, "depth=", 6) == 0 && atoi(pred + 6) >= 0)
+        {
+            q->maxDepth = atoi(pred + 6);
+        }
+        else if (strpbrk(pred, "<=>") == NULL)
+        {
+            q->glob = pred; // A bare pattern matches names.
+        }
+        else
+        {
+            printf("error: Invalid FIND predicate %s!\n", pred);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief finds entries below a directory, returns the number found
+ *
+ * @param path
+ * @param expr
+ * @return int
+ */
+int FIND(char *path, char *expr)
+{
+    char *arr[PATH_MAXDEPTH]; // Array to store split path components
+    char temp[PATH_MAXLEN], exprBuf[PATH_MAXLEN];
+    findQuery q;
+
+    int n = split(path, temp, arr);
+    if (n < 0 || find_parse(expr, exprBuf, &q) == -1)
+    {
+        return -1;
+    }
+    int startInode = walk(arr, n);
+    if (startInode == -1)
+    {
+        return -1;
+    }
+
+    pool *p = calloc(1, sizeof(pool));
+    findOut *outs = malloc(POOL_MAXTHREADS * sizeof(findOut));
+    if (p == NULL || outs == NULL)
+    {
+        free(p);
+        free(outs);
+        printf("error: Out of memory!\n");
+        return -1;
+    }
+    for (int i = 0; i < POOL_MAXTHREADS; ++i)
+    {
+        outs[i].len = 0;
+        p->workers[i].local = &outs[i];
+    }
+    q.matches = 0;
+    pthread_mutex_init(&q.outLock, NULL);
+    p->visit = find_visit;
+    p->arg = &q;
+
+    // The start directory is level 0 and listed as given
+    find_match(&q, &outs[0], n == 0 ? "/" : arr[n - 1], path, startInode);
+    if (q.maxDepth > 0)
+    {
+        pool_run(p, startInode, path);
+    }
+    for (int i = 0; i < POOL_MAXTHREADS; ++i)
+    {
+        if (outs[i].len > 0)
+        {
+            find_flush(&q, &outs[i]);
+        }
+    }
+
+    pthread_mutex_destroy(&q.outLock);
+    free(outs);
+    free(p);
+    return q.matches;
+}
+
+importEntry *importEntries = NULL; // Host tree being imported, parents before children.
+int importCount = 0, importCap = 0;
+int importStack[PATH_MAXDEPTH]; // Entry index of the directory open at each level of the scan.
+
+/**
+ * @brief nftw() callback recording one host entry of an IMPORT
+ *
+ * @param hostPath
+ * @param st
+ * @param type
+ * @param ftw
+ * @return int
+ */
+int import_scan(const char *hostPath, const struct stat *st, int type, struct FTW *ftw)
+{
+    const char *name = hostPath + ftw->base;
+    int len = strlen(name);
+
+    if (type == FTW_DNR || type == FTW_NS)
+    {
+        printf("error: Cannot read %s!\n", hostPath);
+        return -1;
+    }
+    if ((type != FTW_D && (type != FTW_F || !S_ISREG(st->st_mode))) || (ftw->level == 0 && type != FTW_D))
+    {
+        return ftw->level == 0 ? -1 : 0; // Links and special files have no counterpart; skip them.
+    }
+    if (ftw->level >= PATH_MAXDEPTH || len >= FILENAME_MAXLEN)
+    {
+        printf("error: %s is too deep or its name too long!\n", hostPath);
+        return -1;
+    }
+    if (ftw->level > 0 && strpbrk(name, " \t\n\v\f\r") != NULL)
+    {
+        printf("error: The name of %s contains white space!\n", hostPath); // Entry lines separate fields by it.
+        return -1;
+    }
+    if (type == FTW_F && (st->st_size + BLOCK_SIZE - 1) / BLOCK_SIZE > BLOCK_PTRS)
     {
-        printf("error: Cannot handle directories!\n"); // Cannot handle directories.
-        return -1; // Return error code.
+        printf("error: Size of %s exceeds the limit %d\n", hostPath, BLOCK_PTRS);
+        return -1;
     }
 
-    // free up data blocks used by file
-    for (i = 0; i < inodeTable[item->data.inode].size; ++i)
+    if (importCount == importCap)
+    {
+        importCap = importCap == 0 ? 256 : importCap * 2;
+        importEntries = (importEntry *)realloc(importEntries, importCap * sizeof(importEntry));
+    }
+    importEntry *e = &importEntries[importCount];
+    e->name = strdup(name);
+    e->parent = ftw->level == 0 ? -1 : importStack[ftw->level - 1];
+    e->dir = type == FTW_D;
+    e->size = e->dir ? 0 : (st->st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    e->inlineBytes = 0;
+    if (e->parent != -1)
+    {
+        importEntries[e->parent].inlineBytes += sizeof(int) + len + 1;
+    }
+    if (e->dir)
     {
-        dataBitmap[inodeTable[item->data.inode].blockptrs[i]] = 0; // Mark data block as unused.
+        importStack[ftw->level] = importCount;
     }
+    ++importCount;
+    return 0;
+}
 
-    // free up inode used by the file
-    inodeTable[item->data.inode].used = 0; // Mark inode as unused.
-    inodeTable[item->data.inode].size = 0; // Reset size of file.
-    strcpy(inodeTable[item->data.inode].name, ""); // Clear name of file.
-    delete (&dataTable[inodeTable[currentInode].blockptrs[0]],
-            item->data.inode); // Delete file from parent directory.
-    update_fs(); // Update the file system.
+/**
+ * @brief checks the scanned tree fits in the free inodes and blocks, returns -1 if not
+ *
+ * @return int
+ */
+int import_fits()
+{
+    int blocks = 0;
 
-    return 0; // Return success code.
+    // File blocks, and a block for each directory too big to stay inline
+    for (int i = 0; i < importCount; ++i)
+    {
+        if (importEntries[i].dir)
+        {
+            blocks += 5 + importEntries[i].inlineBytes > INLINE_MAXLEN;
+        }
+        else if (!sparse)
+        {
+            blocks += importEntries[i].size;
+        }
+    }
+    if (importCount > stats.freeInodes)
+    {
+        printf("error: Not enough inodes left!\n");
+        return -1;
+    }
+    if (blocks + stats.reservedBlocks > free_blocks())
+    {
+        printf("error: Not enough space left!\n");
+        return -1;
+    }
+    return 0;
 }
 
 /**
- * @brief copies a file
+ * @brief creates the scanned tree below a directory, parents before children
  *
- * @param srcpath
- * @param dstpath
+ * Blocks are only reserved here; the flush assigns them in contiguous runs.
+ *
+ * @param parentInode
+ * @param name
  * @return int
  */
-int CP(char *srcpath, char *dstpath)
+int import_build(int parentInode, char *name)
 {
-    int i = 0, j = 0, n = 0;
-    char arr[16][8]; // Array to store path components.
-    char temp[64];
-    strcpy(temp, srcpath); // Copy source path to temporary buffer.
-    char *token = strtok(temp, "/");
+    int *inodes = (int *)malloc(importCount * sizeof(int));
+    int result = 0;
 
-    // split the source path by /
-    while (token != NULL)
+    free(importEntries[0].name);
+    importEntries[0].name = strdup(name); // The top directory takes the name given in the image.
+    for (int i = 0; i < importCount && result == 0; ++i)
     {
-        if (strcmp(token, "") != 0)
+        importEntry *e = &importEntries[i];
+        int parent = e->parent == -1 ? parentInode : inodes[e->parent];
+
+        inodes[i] = e->dir ? alloc_inode(parent, 1) : alloc_file(parent, e->size, -1);
+        if (inodes[i] == -1)
+        {
+            result = -1;
+        }
+        else if (e->dir)
+        {
+            inline_init(inodes[i], parent);
+            if (dir_add(parent, inodes[i], e->name) == -1)
+            {
+                dir_release(inodes[i]);
+                free_inode(inodes[i]);
+                result = -1;
+            }
+        }
+        else if (dir_add(parent, inodes[i], e->name) == -1)
         {
-            strcpy(arr[n], token); // Copy token to array.
-            ++n; // Increment count of path components.
+            free_file(inodes[i]);
+            result = -1;
         }
-        token = strtok(NULL, "/");
     }
-    int currentInode = 0; // Start from root inode.
-    node *item = NULL; // Node pointer.
+    free(inodes);
+    return result;
+}
 
-    // traverse the source path
-    for (i = 0; i < n - 1; ++i)
+/**
+ * @brief imports a host directory tree as a new directory
+ *
+ * @param hostPath
+ * @param path
+ * @return int
+ */
+int IMPORT(char *hostPath, char *path)
+{
+    char *arr[PATH_MAXDEPTH]; // Array to store split path components
+    char temp[PATH_MAXLEN];
+    int result = -1;
+
+    int n = split(path, temp, arr);
+    if (n <= 0)
     {
-        item = find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[i]); // Find directory in path.
-        if (item == NULL)
+        if (n == 0)
         {
-            printf("error: The directory %s in the given path does not exist!\n", arr[i]); // Directory not found.
-            return -1; // Return error code.
+            printf("error: Directory already exists!\n"); // Path names the root directory.
         }
-        currentInode = item->data.inode; // Update current inode.
+        return -1;
+    }
+    int parentInode = walk(arr, n - 1);
+    if (parentInode == -1)
+    {
+        return -1;
+    }
+    if (dir_find(parentInode, arr[n - 1]) != -1)
+    {
+        printf("error: Directory already exists!\n");
+        return -1;
     }
-    item = find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[n - 1]); // Find source file.
 
-    // check if source file exists
-    if (item == NULL)
+    // Read the whole host tree first, so nothing changes if any of it cannot be imported
+    importCount = 0;
+    if (nftw(hostPath, import_scan, 64, FTW_PHYS) != 0 || importCount == 0)
     {
-        printf("error: File %s not found!\n", srcpath); // Source file not found.
-        return -1; // Return error code.
+        printf("error: Cannot import %s!\n", hostPath);
     }
-    else if (inodeTable[item->data.inode].dir == 1)
+    else if (import_fits() == 0)
     {
-        printf("error: Cannot handle directories!\n"); // Cannot handle directories.
-        return -1; // Return error code.
+        result = import_build(parentInode, arr[n - 1]);
+        if (result == -1 && dir_find(parentInode, arr[n - 1]) != -1)
+        {
+            DD(path); // Take back the part already imported.
+        }
+        else if (result == 0)
+        {
+            update_fs(); // One streaming write of the image.
+        }
     }
-    i = 0;
-    j = 0;
-    n = 0;
-    for (i = 0; i < 16; ++i)
+
+    for (int i = 0; i < importCount; ++i)
     {
-        strcpy(arr[i], ""); // Clear array.
+        free(importEntries[i].name);
     }
+    importCount = 0;
+    return result;
+}
 
-    strcpy(temp, dstpath); // Copy destination path to temporary buffer.
-    token = strtok(temp, "/");
+/**
+ * @brief writes a ustar header, returns -1 if the name does not fit
+ *
+ * @param tar
+ * @param name
+ * @param dir
+ * @param bytes
+ * @return int
+ */
+int tar_header(FILE *tar, char *name, int dir, long long bytes)
+{
+    unsigned char h[TAR_BLOCK] = {0};
+    char *base = name;
+    int len = strlen(name), sum = 0;
 
-    // split the destination path by /
-    while (token != NULL)
+    // Names over 100 bytes are split at a '/' into the 155 byte prefix field
+    if (len > 100)
     {
-        if (strcmp(token, "") != 0)
+        for (base = name + len - 100; *base != '\0' && *base != '/'; ++base)
+            ;
+        if (*base == '\0' || base - name > 155)
         {
-            strcpy(arr[n], token); // Copy token to array.
-            ++n; // Increment count of path components.
+            printf("error: %s is too long for a tar archive!\n", name);
+            return -1;
         }
-        token = strtok(NULL, "/");
+        memcpy(h + 345, name, base - name);
+        ++base;
     }
-    currentInode = 0; // Start from root inode.
-    node *item2 = NULL; // Node pointer.
+    memcpy(h, base, strlen(base));
+    sprintf((char *)h + 100, "%07o", dir ? 0755 : 0644);
+    sprintf((char *)h + 108, "%07o", 0);
+    sprintf((char *)h + 116, "%07o", 0);
+    sprintf((char *)h + 124, "%011llo", bytes);
+    sprintf((char *)h + 136, "%011llo", (long long)time(NULL));
+    h[156] = dir ? '5' : '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
 
-    // traverse the destination path
-    for (i = 0; i < n - 1; ++i)
+    memset(h + 148, ' ', 8); // The checksum is taken with its own field blank.
+    for (int i = 0; i < TAR_BLOCK; ++i)
+    {
+        sum += h[i];
+    }
+    sprintf((char *)h + 148, "%06o", sum);
+    h[155] = ' ';
+    return fwrite(h, 1, TAR_BLOCK, tar) == TAR_BLOCK ? 0 : -1;
+}
+
+/**
+ * @brief writes one entry to a host directory or tar archive
+ *
+ * @param out
+ * @param inode
+ * @param tar
+ * @return int
+ */
+int export_entry(char *out, int inode, FILE *tar)
+{
+    static const char zeros[BLOCK_SIZE]; // Contents are not stored; files export as zeros.
+    long long bytes = (long long)inodeSize[inode] * BLOCK_SIZE;
+
+    if (tar != NULL)
     {
-        item2 = find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[i]); // Find directory in path.
-        if (item2 == NULL)
+        if (tar_header(tar, out, inode_dir(inode), inode_dir(inode) ? 0 : bytes) == -1)
         {
-            printf("error: The directory %s in the given path does not exist!\n", arr[i]); // Directory not found.
-            return -1; // Return error code.
+            return -1;
+        }
+        for (int k = 0; !inode_dir(inode) && k < inodeSize[inode]; ++k)
+        {
+            fwrite(zeros, 1, BLOCK_SIZE, tar); // Block sized, so no padding to TAR_BLOCK.
         }
-        currentInode = item2->data.inode; // Update current inode.
+        return ferror(tar) ? -1 : 0;
     }
 
-    // check if target file already exists
-    item2 = find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[n - 1]);
-    if (item2 != NULL)
+    if (inode_dir(inode))
     {
-        printf("error: The file already exists!\n"); // File already exists.
-        return -1; // Return error code.
+        return mkdir(out, 0755) == 0 ? 0 : -1;
+    }
+    FILE *f = fopen(out, "w");
+    if (f == NULL)
+    {
+        return -1;
     }
+    int result = ftruncate(fileno(f), bytes); // Zero filled, and sparse where the host allows.
+    return fclose(f) == 0 && result == 0 ? 0 : -1;
+}
 
-    i = 0;
-    j = 0;
-    int k = 0;
+/**
+ * @brief exports the entries below a directory, depth first
+ *
+ * @param dirInode
+ * @param out
+ * @param len
+ * @param tar
+ * @return int
+ */
+int export_dir(int dirInode, char *out, int len, FILE *tar)
+{
+    diriter it;
 
-    // finds a free inode
-    while (inodeTable[i].used != 0)
+    dir_open(&it, dirInode);
+    while (dir_next(&it))
     {
-        ++i; // Move to the next inode.
-        if (i == 16)
+        if (strcmp(it.name, ".") == 0 || strcmp(it.name, "..") == 0)
         {
-            printf("error: All inodes in use!\n"); // All inodes are in use.
-            return -1; // Return error code.
+            continue;
+        }
+        int childLen = len + 1 + strlen(it.name);
+        if (childLen + 1 >= PATH_MAXLEN)
+        {
+            printf("error: %s/%s is too long!\n", out, it.name);
+            return -1;
+        }
+        sprintf(out + len, "/%s%s", it.name, tar != NULL && inode_dir(it.inode) ? "/" : "");
+        if (export_entry(out, it.inode, tar) == -1)
+        {
+            printf("error: Cannot write %s!\n", out);
+            return -1;
+        }
+        out[childLen] = '\0'; // Drop the '/' tar puts after directory names.
+        if (inode_dir(it.inode) && export_dir(it.inode, out, childLen, tar) == -1)
+        {
+            return -1;
         }
     }
+    out[len] = '\0';
+    return 0;
+}
+
+/**
+ * @brief exports a directory tree to a host directory, or to a tar archive if the name ends in .tar
+ *
+ * @param path
+ * @param hostPath
+ * @return int
+ */
+int EXPORT(char *path, char *hostPath)
+{
+    char *arr[PATH_MAXDEPTH]; // Array to store split path components
+    char temp[PATH_MAXLEN], out[PATH_MAXLEN];
+    int len = strlen(hostPath), result;
+    FILE *tar = NULL;
 
-    inodeTable[i].used = 1; // Mark inode as used.
-    inodeTable[i].dir = 0; // Set inode as a file, not directory.
-    strcpy(inodeTable[i].name, arr[n - 1]); // Copy name of file.
-    inodeTable[i].size = inodeTable[item->data.inode].size; // Copy size of source file.
+    int n = split(path, temp, arr);
+    if (n < 0)
+    {
+        return -1;
+    }
+    int dirInode = walk(arr, n);
+    if (dirInode == -1)
+    {
+        return -1;
+    }
+    if (len >= PATH_MAXLEN)
+    {
+        printf("error: %s is too long!\n", hostPath);
+        return -1;
+    }
 
-    // finds free data blocks
-    for (k = 0; k < inodeTable[i].size; ++k)
+    if (len > 4 && strcmp(hostPath + len - 4, ".tar") == 0)
     {
-        while (dataBitmap[j] != 0)
+        // Archive members are named from the exported directory down
+        tar = fopen(hostPath, "wb");
+        if (tar == NULL)
         {
-            ++j; // Move to the next data block.
-            if (j == 127)
-            {
-                printf("error: Not enough space left!\n"); // No space left for data blocks.
-                return -1; // Return error code.
-            }
+            printf("error: Cannot write %s!\n", hostPath);
+            return -1;
+        }
+        len = sprintf(out, "%s", n == 0 ? "." : arr[n - 1]);
+        result = tar_header(tar, strcat(out, "/"), 1, 0);
+        out[len] = '\0';
+    }
+    else
+    {
+        len = sprintf(out, "%s", hostPath);
+        result = export_entry(out, dirInode, NULL);
+        if (result == -1)
+        {
+            printf("error: Cannot write %s!\n", hostPath);
         }
-        inodeTable[i].blockptrs[k] = j; // Assign data block to inode.
-        dataBitmap[j] = 1; // Mark data block as used.
     }
 
-    // add the file to parent data table
-    push(&dataTable[inodeTable[currentInode].blockptrs[0]], i, arr[n - 1]); // Add file to parent directory.
-    update_fs(); // Update the file system.
-    return 0; // Return success code.
+    if (result == 0)
+    {
+        result = export_dir(dirInode, out, len, tar);
+    }
+    if (tar != NULL)
+    {
+        static const char end[2 * TAR_BLOCK]; // Two zero records end an archive.
+        fwrite(end, 1, sizeof(end), tar);
+        if (fclose(tar) != 0 && result == 0)
+        {
+            printf("error: Cannot write %s!\n", hostPath);
+            result = -1;
+        }
+    }
+    return result;
 }
 
+// inode record, the layout the parallel arrays replaced; only kept for comparison in bench_inodes()
+typedef struct inode
+{
+    int dir;          // boolean value. 1 if it's a directory.
+    int size;         // actual file/directory size in blocks.
+    int blockptrs[BLOCK_PTRS]; // direct pointers to blocks containing file's content.
+    int used;         // boolean value. 1 if the entry is in use.
+    int flags;        // INODE_* flags.
+} inode;
+
 /**
- * @brief moves a file
+ * @brief times table-wide inode scans over the record and the parallel array layouts
  *
- * @param srcpath
- * @param dstpath
  * @return int
  */
-int MV(char *srcpath, char *dstpath)
+int bench_inodes()
 {
-    int i = 0, n = 0;
-    char arr[16][8];
-    char temp[64];
-    strcpy(temp, srcpath);
-    char *token = strtok(temp, "/");
+    int n = BENCH_INODES, words = (n + 63) / 64, found = 0, count = 0;
+    inode *records = (inode *)calloc(n, sizeof(inode));
+    unsigned long long *used = (unsigned long long *)calloc(words, sizeof(unsigned long long));
+    unsigned long long *dir = (unsigned long long *)calloc(words, sizeof(unsigned long long));
+    long long t0, aosFree, soaFree, aosDirs, soaDirs;
 
-    // split source path by /
-    while (token != NULL)
+    if (records == NULL || used == NULL || dir == NULL)
     {
-        if (strcmp(token, "") != 0)
+        printf("error: Not enough memory for the benchmark!\n");
+        return -1;
+    }
+
+    // A nearly full table: every inode in use but the last, one in eight a directory
+    for (int i = 0; i < n - 1; ++i)
+    {
+        records[i].used = 1;
+        records[i].dir = i % 8 == 0;
+        set_bit(used, i, 1);
+        set_bit(dir, i, i % 8 == 0);
+    }
+
+    // find a free inode
+    t0 = now_ns();
+    for (int r = 0; r < BENCH_ROUNDS; ++r)
+    {
+        int i = 0;
+        while (i < n && records[i].used != 0)
         {
-            strcpy(arr[n], token); // Copy token to array.
-            ++n; // Increment count of path components.
+            ++i;
         }
-        token = strtok(NULL, "/");
+        found += i;
     }
-    int currentInode = 0; // Start from root inode.
-    node *item = NULL; // Node pointer.
+    aosFree = now_ns() - t0;
+    t0 = now_ns();
+    for (int r = 0; r < BENCH_ROUNDS; ++r)
+    {
+        found -= find_zero(used, 0, n);
+    }
+    soaFree = now_ns() - t0;
 
-    // traverse source path
-    for (i = 0; i < n - 1; ++i)
+    // count directories
+    t0 = now_ns();
+    for (int r = 0; r < BENCH_ROUNDS; ++r)
     {
-        item = find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[i]); // Find directory in path.
-        if (item == NULL)
+        for (int i = 0; i < n; ++i)
         {
-            printf("error: The directory %s in the given path does not exist!\n", arr[i]); // Directory not found.
-            return -1; // Return error code.
+            count += records[i].used && records[i].dir;
         }
-        currentInode = item->data.inode; // Update current inode.
     }
-    item = find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[n - 1]); // Find source file.
+    aosDirs = now_ns() - t0;
+    t0 = now_ns();
+    for (int r = 0; r < BENCH_ROUNDS; ++r)
+    {
+        count -= count_both(used, dir, words);
+    }
+    soaDirs = now_ns() - t0;
 
-    // check if source file exists
-    if (item == NULL)
+    printf("inodes: %d, rounds: %d\n", n, BENCH_ROUNDS);
+    printf("bytes per inode: records %zu, arrays %.2f\n", sizeof(inode),
+           2.0 / 8 + sizeof(inodeFlags[0]) + sizeof(inodeSize[0]) + sizeof(inodeBlocks[0]));
+    printf("find free inode: records %.3f ms, arrays %.3f ms, speedup %.1fx\n",
+           aosFree / 1e6 / BENCH_ROUNDS, soaFree / 1e6 / BENCH_ROUNDS, (double)aosFree / soaFree);
+    printf("count directories: records %.3f ms, arrays %.3f ms, speedup %.1fx\n",
+           aosDirs / 1e6 / BENCH_ROUNDS, soaDirs / 1e6 / BENCH_ROUNDS, (double)aosDirs / soaDirs);
+
+    free(records);
+    free(used);
+    free(dir);
+    return found == 0 && count == 0 ? 0 : -1; // Both layouts must agree.
+}
+
+/**
+ * @brief times the CRC32C kernels on record sized and block sized buffers
+ *
+ * @return int
+ */
+int bench_crc()
+{
+    size_t sizes[] = {64, 4096, 1 << 20};
+    unsigned char *buf = (unsigned char *)malloc(1 << 20);
+    unsigned int crc = 0, check;
+
+    crc32c_init();
+    for (int i = 0; i < (1 << 20); ++i)
     {
-        printf("error: File %s does not exist!\n", srcpath); // Source file not found.
-        return -1; // Return error code.
+        buf[i] = (unsigned char)(i * 2654435761u >> 24);
     }
-    else if (inodeTable[item->data.inode].dir == 1)
+
+    // Both kernels must produce the standard check value
+    check = ~crc32c_table(~0u, (const unsigned char *)"123456789", 9);
+    if (check != 0xe3069283 || crc32c(0, "123456789", 9) != check)
     {
-        printf("error: Cannot handle directories!\n"); // Cannot handle directories.
-        return -1; // Return error code.
+        printf("error: CRC32C check value mismatch!\n");
+        free(buf);
+        return -1;
+    }
+
+    printf("crc32c kernel: %s\n", crcKernel == crc32c_table ? "table" : "sse4.2");
+    for (int s = 0; s < 3; ++s)
+    {
+        long long rounds = (256LL << 20) / sizes[s], t0, table, kernel;
+
+        t0 = now_ns();
+        for (long long r = 0; r < rounds; ++r)
+        {
+            crc = crc32c_table(crc, buf, sizes[s]);
+        }
+        table = now_ns() - t0;
+        t0 = now_ns();
+        for (long long r = 0; r < rounds; ++r)
+        {
+            crc = crcKernel(crc, buf, sizes[s]);
+        }
+        kernel = now_ns() - t0;
+
+        printf("crc32c %zu bytes: table %.2f GB/s, selected %.2f GB/s\n", sizes[s],
+               rounds * sizes[s] / (double)table, rounds * sizes[s] / (double)kernel);
     }
-    i = 0;
-    n = 0;
-    int dataTableSrc = inodeTable[currentInode].blockptrs[0];
-    for (i = 0; i < 16; ++i)
+
+    free(buf);
+    return crc == 1 ? -1 : 0; // Keep the loops from being optimized away.
+}
+
+/**
+ * @brief times filling and emptying the inode table and the block bitmaps through the allocators
+ *
+ * The tables have the geometry of the build profile, so the time per
+ * allocation compares profiles; make profiles runs it on each of them.
+ *
+ * @return int
+ */
+int bench_alloc()
+{
+    long long rounds = (1 << 22) / (INODE_COUNT + BLOCK_COUNT) + 1, t0, elapsed;
+    int failed = 0;
+
+    for (int g = 0; g < GROUP_COUNT; ++g)
     {
-        strcpy(arr[i], ""); // Clear array.
+        pthread_mutex_init(&groups[g].lock, NULL);
     }
-    strcpy(temp, dstpath); // Copy destination path to temporary buffer.
-    token = strtok(temp, "/");
+    reset_fs(); // Empty tables.
 
-    // split the destination path by /
-    while (token != NULL)
+    t0 = now_ns();
+    for (long long r = 0; r < rounds; ++r)
+    {
+        for (int i = 0; i < INODE_COUNT; ++i)
+        {
+            failed |= alloc_inode(0, 0) == -1;
+        }
+        for (int j = 0; j < BLOCK_COUNT; ++j)
+        {
+            failed |= alloc_block(j / GROUP_BLOCKS) == -1;
+        }
+        for (int i = 0; i < INODE_COUNT; ++i)
+        {
+            free_inode(i);
+        }
+        for (int j = 0; j < BLOCK_COUNT; ++j)
+        {
+            free_block(j);
+        }
+    }
+    elapsed = now_ns() - t0;
+
+    printf("alloc: %s profile, %d inodes, %d blocks, %.1f ns per allocation\n", CONFIG_PROFILE,
+           INODE_COUNT, BLOCK_COUNT, (double)elapsed / rounds / (INODE_COUNT + BLOCK_COUNT));
+    reset_fs();
+    return failed ? -1 : 0; // Every allocation must succeed on an empty table.
+}
+
+/**
+ * @brief returns the opcode of a command name of len bytes, or OP_NONE
+ *
+ * The first two letters tell every command apart, so one switch picks the
+ * candidate and a single compare confirms it.
+ *
+ * @param name
+ * @param len
+ * @return int
+ */
+int opcode(char *name, int len)
+{
+    int op;
+
+    if (len < 2)
+    {
+        return OP_NONE;
+    }
+    switch (name[0] << 8 | name[1])
+    {
+    case 'C' << 8 | 'R':
+        op = OP_CR;
+        break;
+    case 'D' << 8 | 'L':
+        op = OP_DL;
+        break;
+    case 'C' << 8 | 'P':
+        op = OP_CP;
+        break;
+    case 'M' << 8 | 'V':
+        op = OP_MV;
+        break;
+    case 'C' << 8 | 'D':
+        op = OP_CD;
+        break;
+    case 'D' << 8 | 'D':
+        op = OP_DD;
+        break;
+    case 'L' << 8 | 'L':
+        op = OP_LL;
+        break;
+    case 'D' << 8 | 'F':
+        op = OP_DF;
+        break;
+    case 'F' << 8 | 'I':
+        op = OP_FIND;
+        break;
+    case 'I' << 8 | 'M':
+        op = OP_IMPORT;
+        break;
+    case 'E' << 8 | 'X':
+        op = OP_EXPORT;
+        break;
+    case 'L' << 8 | 'S':
+        op = OP_LS;
+        break;
+    case 'F' << 8 | 'S':
+        op = OP_FSCK;
+        break;
+    default:
+        return OP_NONE;
+    }
+    return (int)strlen(opnames[op]) == len && memcmp(name, opnames[op], len) == 0 ? op : OP_NONE;
+}
+
+/**
+ * @brief splits the next script line in place, returns its opcode or OP_NONE
+ *
+ * Tokens are NULL terminated inside the script itself and tok points at
+ * them, so lines of any length are read without copying. The line must
+ * end in a newline, which is overwritten.
+ *
+ * @param cur
+ * @param tok
+ * @return int
+ */
+int script_line(char **cur, char *tok[3])
+{
+    char *p = *cur, *start;
+    int n = 0, len = 0;
+
+    tok[0] = tok[1] = tok[2] = "";
+    while (*p != '\n')
     {
-        if (strcmp(token, "") != 0)
+        while (*p == ' ')
         {
-            strcpy(arr[n], token); // Copy token to array.
-            ++n; // Increment count of path components.
+            ++p; // Runs of spaces separate tokens.
         }
-        token = strtok(NULL, "/");
-    }
-    currentInode = 0; // Start from root inode.
-    node *item2 = NULL; // Node pointer.
-
-    // traverse the destination path
-    for (i = 0; i < n - 1; ++i)
-    {
-        item2 = find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[i]); // Find directory in path.
-        if (item2 == NULL)
+        if (*p == '\n')
         {
-            printf("error: The directory %s in the given path does not exist!\n", arr[i]); // Directory not found.
-            return -1; // Return error code.
+            break;
+        }
+        start = p;
+        while (*p != ' ' && *p != '\n')
+        {
+            ++p;
+        }
+        if (n < 3)
+        {
+            len = n == 0 ? p - start : len;
+            tok[n++] = start;
+        }
+        if (*p == ' ')
+        {
+            *p++ = '\0';
         }
-        currentInode = item2->data.inode; // Update current inode.
-    }
-    item2 = find(dataTable[inodeTable[currentInode].blockptrs[0]], item->data.name); // Find target item.
-
-    // checks if destination file already exists
-    if (item2 != NULL)
-    {
-        printf("error: The file already exists!\n"); // File already exists.
-        return -1; // Return error code.
     }
-
-    // update the inode for existing file
-    push(&dataTable[inodeTable[currentInode].blockptrs[0]], item->data.inode, arr[n - 1]); // Add file to destination directory.
-    strcpy(inodeTable[item->data.inode].name, arr[n - 1]); // Update file name.
-    delete (&dataTable[dataTableSrc], item->data.inode); // Delete file from source directory.
-    update_fs(); // Update the file system.
-    return 0; // Return success code.
+    *p = '\0';
+    *cur = p + 1;
+    return n == 0 ? OP_NONE : opcode(tok[0], len);
 }
 
 /**
- * @brief creates a directory
+ * @brief executes one command and returns its result code
  *
- * @param path
+ * @param op
+ * @param arg1
+ * @param arg2
+ * @param size
  * @return int
  */
-int CD(char *path)
+int execute(int op, char *arg1, char *arg2, int size)
 {
-    int i = 0, n = 0;
-    char arr[16][8];
-    char temp[64];
-    strcpy(temp, path);
-    char *token = strtok(temp, "/");
+    int result = -1; // Unknown command.
+    long long begin = PROBE_CLOCK(command_return); // Includes waiting for the image lock.
 
-    // Split the path by /
-    while (token != NULL)
+    PROBE(command_entry, opnames[op], arg1, arg2);
+    if (fs_lock(op_writes[op]) == -1)
     {
-        strcpy(arr[n], token); // Copy token to array.
-        token = strtok(NULL, "/");
-        ++n; // Increment count of path components.
+        PROBE(command_return, opnames[op], -1, PROBE_SINCE(begin));
+        return -1;
     }
-    int currentInode = 0; // Start from root inode.
-    node *item = NULL; // Node pointer.
-
-    // Traverse the path
-    for (i = 0; i < n - 1; ++i)
+    switch (op)
     {
-        item = find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[i]); // Find directory in path.
-        if (item == NULL)
-        {
-            printf("error: %s not in directory %s!\n", arr[i], inodeTable[currentInode].name); // Directory not found in current directory.
-            return -1; // Return error code.
-        }
-        currentInode = item->data.inode; // Update current inode.
+    case OP_CR:
+        result = CR(arg1, size); // File create
+        break;
+    case OP_DL:
+        result = DL(arg1); // File delete
+        break;
+    case OP_CP:
+        result = CP(arg1, arg2); // File copy
+        break;
+    case OP_MV:
+        result = MV(arg1, arg2); // File move
+        break;
+    case OP_CD:
+        result = CD(arg1); // Create directory
+        break;
+    case OP_DD:
+        result = DD(arg1); // Delete directory
+        break;
+    case OP_LL:
+        result = LL("/"); // List files and directories
+        break;
+    case OP_DF:
+        result = DF(); // Report usage
+        break;
+    case OP_FIND:
+        result = FIND(arg1, arg2); // Find entries
+        break;
+    case OP_IMPORT:
+        result = IMPORT(arg1, arg2); // Import a host directory
+        break;
+    case OP_EXPORT:
+        result = EXPORT(arg1, arg2); // Export to a host directory or tar archive
+        break;
+    case OP_LS:
+        result = LS(arg1, arg2); // List a page of a directory
+        break;
+    case OP_FSCK:
+        result = FSCK(arg1); // Check the image, repairing it if asked
+        break;
     }
-    item = find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[n - 1]); // Find target directory.
+    cache_trim(); // Between commands, no directory is being walked.
+#if CONFIG_CHECKS
+    check_stats(op);
+#endif
+    fs_unlock();
+    PROBE(command_return, opnames[op], result, PROBE_SINCE(begin));
+    return result;
+}
 
-    // Check if the target directory already exists
-    if (item != NULL)
+/**
+ * @brief writes an unsigned LEB128 varint
+ *
+ * @param out
+ * @param v
+ */
+void put_varint(FILE *out, unsigned long long v)
+{
+    while (v >= 0x80)
     {
-        printf("error: Directory already exists!\n"); // Directory already exists.
-        return -1; // Return error code.
+        putc((int)(v & 0x7f) | 0x80, out); // Low 7 bits, more to follow.
+        v >>= 7;
     }
+    putc((int)v, out);
+}
 
-    i = 0;
-    int j = 0;
-
-    // Find an unused inode
-    while (inodeTable[i].used != 0)
+/**
+ * @brief reads an unsigned LEB128 varint, returns -1 at end of file
+ *
+ * @param in
+ * @param v
+ * @return int
+ */
+int get_varint(FILE *in, unsigned long long *v)
+{
+    int c, shift = 0;
+    *v = 0;
+    do
     {
-        ++i; // Move to next inode.
-        if (i == 16)
+        if ((c = getc(in)) == EOF || shift > 63)
         {
-            printf("error: All inodes in use!\n"); // All inodes are in use.
-            return -1; // Return error code.
+            return -1; // Truncated or malformed varint.
         }
-    }
-    inodeTable[i].used = 1;
-    inodeTable[i].dir = 1;
-    strcpy(inodeTable[i].name, arr[n - 1]); // Copy directory name to inode.
-    inodeTable[i].size = 1;
+        *v |= (unsigned long long)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 0;
+}
+
+/**
+ * @brief writes a length prefixed string
+ *
+ * @param out
+ * @param s
+ */
+void put_string(FILE *out, char *s)
+{
+    int len = strlen(s);
+    put_varint(out, len);
+    fwrite(s, 1, len, out);
+}
 
-    // Find unused data block
-    while (dataBitmap[j] != 0)
+/**
+ * @brief reads a length prefixed string into buf of PATH_MAXLEN bytes, returns -1 on error
+ *
+ * @param in
+ * @param buf
+ * @return int
+ */
+int get_string(FILE *in, char *buf)
+{
+    unsigned long long len;
+    if (get_varint(in, &len) == -1 || len >= PATH_MAXLEN || fread(buf, 1, len, in) != len)
     {
-        ++j; // Move to next data block.
-        if (j == 127)
-        {
-            printf("error: Not enough space left!\n"); // No available data blocks.
-            return -1; // Return error code.
-        }
+        return -1; // Truncated or oversized string.
     }
-
-    // Set inode and data table
-    inodeTable[i].blockptrs[0] = j; // Set block pointer.
-    dataBitmap[j] = 1; // Mark data block as used.
-    push(&dataTable[j], i, "."); // Add '.' entry to data block.
-    push(&dataTable[j], currentInode, ".."); // Add '..' entry to data block.
-    push(&dataTable[inodeTable[currentInode].blockptrs[0]], i, arr[n - 1]); // Add directory to parent data block.
-    update_fs(); // Update the file system.
-
-    return 0; // Return success code.
+    buf[len] = '\0';
+    return 0;
 }
 
 /**
- * @brief deletes a directory
+ * @brief opens a trace file for writing and writes its header
  *
  * @param path
- * @return int
+ * @param flags
+ * @return FILE*
  */
-int DD(char *path)
+FILE *trace_open(char *path, int flags)
 {
-    // Initialize variables
-    int i = 0, n = 0;
-    char arr[16][8]; // Array to store split path components
-    char temp[64];
-    strcpy(temp, path);
-    char *token = strtok(temp, "/"); // Tokenize the path
-
-    // Split the path by /
-    while (token != NULL)
+    FILE *out = fopen(path, "wb");
+    if (out == NULL)
     {
-        if (strcmp(token, "") != 0) // Check if token is not empty
-        {
-            strcpy(arr[n], token); // Copy token to arr
-            ++n;
-        }
-        token = strtok(NULL, "/"); // Get next token
+        printf("error: Cannot open trace %s!\n", path);
+        return NULL;
     }
+    setvbuf(out, NULL, _IOFBF, 1 << 16); // Records are small, write them in large chunks.
+    fwrite(TRACE_MAGIC, 1, 4, out);
+    put_varint(out, TRACE_VERSION);
+    put_varint(out, flags);
+    return out;
+}
 
-    // Check if trying to delete root directory
-    if (n == 0)
+/**
+ * @brief appends an executed command to a trace
+ *
+ * Each record holds the time since the previous record, the opcode, the
+ * zigzag encoded result, the command's latency and its arguments, all as
+ * varints or length prefixed strings.
+ *
+ * @param out
+ * @param rec
+ */
+void trace_write(FILE *out, traceRecord *rec)
+{
+    put_varint(out, rec->delta);
+    putc(rec->op, out);
+    put_varint(out, ((unsigned long long)rec->result << 1) ^ (unsigned long long)(rec->result >> 31)); // Zigzag.
+    put_varint(out, rec->latency);
+    if (op_args[rec->op] >= 1)
     {
-        printf("error: Cannot delete root directory!\n");
-        return -1;
+        put_string(out, rec->arg1);
     }
-
-    int currentInode = 0; // Initialize with root inode
-    node *item = NULL;
-
-    // Traverse the given path
-    for (i = 0; i < n - 1; ++i)
+    if (op_args[rec->op] >= 2)
     {
-        item = find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[i]);
-        if (item == NULL)
-        {
-            printf(
-                "error: The directory %s in the given path does not exist!\n",
-                arr[i]);
-            return -1;
-        }
-        else
-        {
-            currentInode = item->data.inode; // Update current inode
-        }
+        put_string(out, rec->arg2);
     }
+    if (rec->op == OP_CR)
+    {
+        put_varint(out, rec->size);
+    }
+}
 
-    item = find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[n - 1]);
+/**
+ * @brief reads the next record of a trace, returns 0 at the end and -1 on a malformed record
+ *
+ * @param in
+ * @param rec
+ * @return int
+ */
+int trace_read(FILE *in, traceRecord *rec)
+{
+    unsigned long long v;
+    int c;
 
-    // Check if target directory exists
-    if (item == NULL)
+    if (get_varint(in, &rec->delta) == -1)
     {
-        printf("error: The directory does not exist!\n");
-        return -1;
+        return 0; // Clean end of trace.
     }
-    else if (inodeTable[item->data.inode].dir == 0)
+    if ((c = getc(in)) == EOF || c >= OP_COUNT || get_varint(in, &v) == -1 ||
+        get_varint(in, &rec->latency) == -1)
     {
-        printf("error: Cannot handle files!\n");
+        return -1; // Malformed record.
     }
-    else
+    rec->op = c;
+    rec->result = (int)(v >> 1) ^ -(int)(v & 1); // Undo zigzag.
+    rec->arg1[0] = rec->arg2[0] = '\0';
+    rec->size = 0;
+    if ((op_args[rec->op] >= 1 && get_string(in, rec->arg1) == -1) ||
+        (op_args[rec->op] >= 2 && get_string(in, rec->arg2) == -1))
     {
-        node *tempNode;
-        char childPath[64];
-        currentInode = item->data.inode;
-        int parentInode =
-            find(dataTable[inodeTable[currentInode].blockptrs[0]], "..")
-                ->data.inode;
-
-        // Loop through items in directory
-        while (length(dataTable[inodeTable[currentInode].blockptrs[0]]) > 0)
+        return -1; // Malformed record.
+    }
+    if (rec->op == OP_CR)
+    {
+        if (get_varint(in, &v) == -1)
         {
-            tempNode = get(dataTable[inodeTable[currentInode].blockptrs[0]], 0);
-            if (strcmp(tempNode->data.name, ".") != 0 &&
-                strcmp(tempNode->data.name, "..") != 0)
-            {
-                // Recursive call for sub directories
-                if (inodeTable[tempNode->data.inode].dir == 1)
-                {
-                    strcpy(childPath, path);
-                    strcat(childPath, "/");
-                    strcat(childPath, tempNode->data.name);
-                    DD(childPath);
-                }
-
-                // Delete files inside directory
-                else
-                {
-                    for (i = 0; i < inodeTable[tempNode->data.inode].size; ++i)
-                    {
-                        dataBitmap[inodeTable[tempNode->data.inode]
-                                       .blockptrs[i]] = 0;
-                    }
-                    inodeTable[tempNode->data.inode].used = 0;
-                    inodeTable[tempNode->data.inode].size = 0;
-                    strcpy(inodeTable[tempNode->data.inode].name, "");
-                    delete (&dataTable[inodeTable[currentInode].blockptrs[0]],
-                            tempNode->data.inode);
-                }
-            }
-            else
-            {
-                // Delete . and .. from data table
-                delete (&dataTable[inodeTable[currentInode].blockptrs[0]],
-                        tempNode->data.inode);
-            }
+            return -1; // Malformed record.
         }
-
-        // Delete inode of directory
-        delete (&dataTable[inodeTable[parentInode].blockptrs[0]], currentInode);
-        dataBitmap[inodeTable[currentInode].blockptrs[0]] = 0;
-        inodeTable[currentInode].used = 0;
-        inodeTable[currentInode].size = 0;
-        strcpy(inodeTable[currentInode].name, "");
-        update_fs(); // Update the file system.
-        return 0; // Return success code.
+        rec->size = (int)v;
     }
-    return 0; // Return success code.
+    return 1;
 }
 
 /**
- * @brief lists files and directories
+ * @brief replays a trace against the current image, reports throughput and divergence
  *
  * @param path
+ * @param paced
  * @return int
  */
-int LL(char *path)
+int replay(char *path, int paced)
 {
-    // Initialize variables
-    int i = 0, n = 0;
-    char arr[16][8]; // Array to store split path components
-    char temp[64];
-    strcpy(temp, path);
-    char *token = strtok(temp, "/"); // Tokenize the path
-
-    // Split the path by /
-    while (token != NULL)
-    {
-        if (strcmp(token, "") != 0) // Check if token is not empty
-        {
-            strcpy(arr[n], token); // Copy token to arr
-            ++n;
-        }
-        token = strtok(NULL, "/"); // Get next token
-    }
-
-    int currentInode = 0; // Initialize with root inode
-    node *item = NULL;
-    int size = 0;
+    FILE *in = fopen(path, "rb");
+    char magic[4];
+    unsigned long long version, flags = 0, recorded = 0;
+    char arg1[PATH_MAXLEN], arg2[PATH_MAXLEN];
+    traceRecord rec = {.arg1 = arg1, .arg2 = arg2};
+    long long ops = 0, diverged = 0, start, elapsed;
+    int rc;
 
-    // Traverse the path
-    for (i = 0; i < n - 1; ++i)
+    if (in == NULL || fread(magic, 1, 4, in) != 4 || memcmp(magic, TRACE_MAGIC, 4) != 0 ||
+        get_varint(in, &version) == -1 || version < 1 || version > TRACE_VERSION ||
+        (version >= 2 && get_varint(in, &flags) == -1))
     {
-        item = find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[i]);
-        if (item == NULL)
+        printf("error: %s is not a trace!\n", path);
+        if (in != NULL)
         {
-            printf(
-                "error: The directory %s in the given path does not exist!\n",
-                arr[i]);
-            return -1;
+            fclose(in);
         }
-        currentInode = item->data.inode; // Update current inode
+        return -1;
     }
+    setvbuf(in, NULL, _IOFBF, 1 << 16);
 
-    // Handle root directory
-    if (n == 0)
+    if (init_fs() == -1)
     {
-        currentInode = 0;
+        fclose(in);
+        return -1;
     }
-    else
+    start = now_ns();
+    while ((rc = trace_read(in, &rec)) == 1)
     {
-        currentInode =
-            find(dataTable[inodeTable[currentInode].blockptrs[0]], arr[n - 1])
-                ->data.inode;
-    }
-    char childPath[64];
+        recorded += rec.delta;
 
-    // Loop through items in directory
-    for (i = 0; i < length(dataTable[inodeTable[currentInode].blockptrs[0]]);
-         ++i)
-    {
-        item = get(dataTable[inodeTable[currentInode].blockptrs[0]], i);
-        if (strcmp(item->data.name, ".") != 0 &&
-            strcmp(item->data.name, "..") != 0)
+        // At original pacing, wait until the command's offset from the start of the trace
+        if (paced && !(flags & TRACE_SCRIPT))
         {
-            strcpy(childPath, strcmp(path, "/") == 0 ? "" : path);
-            strcat(childPath, "/");
-            strcat(childPath, item->data.name);
-
-            // Recursive call for subdirectories
-            if (inodeTable[item->data.inode].dir == 1)
+            long long wait = (long long)recorded - (now_ns() - start);
+            if (wait > 0)
             {
-                size += LL(childPath);
+                struct timespec ts = {wait / 1000000000LL, wait % 1000000000LL};
+                nanosleep(&ts, NULL);
             }
-            else
+        }
+
+        int result = execute(rec.op, rec.arg1, rec.arg2, rec.size);
+        ++ops;
+        if (result != rec.result && !(flags & TRACE_SCRIPT)) // A compiled script has nothing to diverge from.
+        {
+            if (diverged < TRACE_MAXREPORT)
             {
-                printf("type: file\npath: %s\nsize: %d\n\n", childPath,
-                       inodeTable[item->data.inode].size);
-                size += inodeTable[item->data.inode].size;
+                fprintf(stderr, "diverged: op %lld %s %s %s: recorded %d, replayed %d\n", ops,
+                        opnames[rec.op], rec.arg1, rec.arg2, rec.result, result);
             }
+            ++diverged;
         }
     }
-    ++size; // Add size of directory
-    printf("type: directory\npath: %s\nsize: %d\n\n", path, size);
-    return size;
+    if (pendingCommits > 0)
+    {
+        sync_fs(); // Write what the last commit interval left pending.
+        fs_unlock();
+    }
+    elapsed = now_ns() - start;
+    fclose(in);
+
+    if (rc == -1)
+    {
+        fprintf(stderr, "error: Trace is truncated after %lld commands!\n", ops);
+    }
+    fprintf(stderr, "replayed %lld commands in %.3f ms (%.0f ops/s), recorded span %.3f ms, %lld diverged\n",
+            ops, elapsed / 1e6, elapsed > 0 ? ops * 1e9 / elapsed : 0.0, recorded / 1e6, diverged);
+    return rc == -1 || diverged > 0 ? -1 : 0;
 }
 
 /**
@@ -1053,83 +5785,213 @@ int LL(char *path)
  */
 int main(int argc, char *argv[])
 {
+    char *tracePath = NULL;
+    int paced = 0, compile = 0, arg = 1;
+
+    // Parse options
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0)
+    {
+        if (strcmp(argv[arg], "--bench") == 0)
+        {
+            return bench_inodes() == -1 || bench_crc() == -1 || bench_alloc() == -1 ? -1 : 0; // Run the benchmarks instead of a script
+        }
+        else if (strcmp(argv[arg], "--fsck") == 0)
+        {
+            // Check the image instead of running a script, repairing it with --fsck repair
+            fsckLoad = 1; // A damaged image is loaded as far as it can be.
+            if (init_fs() == -1)
+            {
+                return -1;
+            }
+            int problems = execute(OP_FSCK, arg + 1 < argc ? argv[arg + 1] : "", "", 0);
+            if (pendingCommits > 0)
+            {
+                sync_fs();
+                fs_unlock();
+            }
+            return problems == 0 ? 0 : -1;
+        }
+        else if (strcmp(argv[arg], "--trace") == 0 && arg + 1 < argc)
+        {
+            tracePath = argv[++arg]; // Record executed commands
+        }
+        else if (strcmp(argv[arg], "--compile") == 0 && arg + 1 < argc)
+        {
+            tracePath = argv[++arg]; // Write the script as a binary script instead of running it
+            compile = 1;
+        }
+        else if (strcmp(argv[arg], "--dedup") == 0)
+        {
+            dedup = 1; // Copies share the blocks of their source
+        }
+        else if (strcmp(argv[arg], "--sparse") == 0)
+        {
+            sparse = 1; // CR leaves files as holes
+        }
+        else if (strcmp(argv[arg], "--commit") == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0)
+        {
+            commitEvery = atoi(argv[++arg]); // Write the image every N commands
+        }
+        else if (strcmp(argv[arg], "--shards") == 0 && arg + 1 < argc && atoi(argv[arg + 1]) > 0 &&
+                 GROUP_COUNT % atoi(argv[arg + 1]) == 0)
+        {
+            shardCount = atoi(argv[++arg]); // Split a new image across N files, by groups
+        }
+        else if (strcmp(argv[arg], "--memory") == 0 && arg + 1 < argc && atoll(argv[arg + 1]) > 0)
+        {
+            cache.budget = atoll(argv[++arg]) * 1024; // Keep at most N KiB of directory entries resident
+        }
+        else if (strcmp(argv[arg], "--paced") == 0)
+        {
+            paced = 1; // Replay at the recorded pace
+        }
+        else if (strcmp(argv[arg], "--replay") == 0 && arg + 1 < argc)
+        {
+            return replay(argv[arg + 1], paced); // Replay a trace instead of a script
+        }
+        else
+        {
+            printf("error: Unknown option %s!\n", argv[arg]);
+            return -1;
+        }
+        ++arg;
+    }
+
     // Check if the number of arguments is correct
-    if (argc != 2)
+    if (argc - arg != 1)
     {
         printf("error: Invalid number of arguments!\n");
         return -1;
     }
 
-    // Open the input file
-    FILE *inpFile = fopen(argv[1], "r");
-
-    // Initialize variables
-    char line[64], inpCommand[3][64], *token = NULL;
-    int i;
-
-    // Initialize the file system
-    init_fs();
-
-    // Read commands from the input file
-    while (fgets(line, sizeof(line), inpFile))
+    // Map the input file; commands are parsed in place
+    struct stat st;
+    int fd = open(argv[arg], O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) == -1)
     {
-        // Remove newline character from the end of the line
-        if (line[strlen(line) - 1] == '\n')
+        printf("error: Cannot open %s!\n", argv[arg]);
+        if (fd != -1)
         {
-            line[strlen(line) - 1] = '\0';
+            close(fd);
         }
+        return -1;
+    }
+    char *script = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (script == MAP_FAILED)
+    {
+        printf("error: Cannot open %s!\n", argv[arg]);
+        return -1;
+    }
 
-        i = 0;
-        token = strtok(line, " ");
+    // A last line without a newline is copied out, so it can be given one
+    char *cur = script, *end = script == NULL ? NULL : script + st.st_size, *tail = NULL, *last;
+    int tailLen = 0;
+    if (st.st_size > 0 && end[-1] != '\n')
+    {
+        last = memrchr(script, '\n', st.st_size);
+        last = last == NULL ? script : last + 1;
+        tailLen = end - last + 1;
+        tail = (char *)malloc(tailLen);
+        memcpy(tail, last, tailLen - 1);
+        tail[tailLen - 1] = '\n';
+        end = last;
+    }
 
-        // Split the input command by " "
-        while (token != NULL)
+    FILE *traceFile = NULL;
+    if (tracePath != NULL && (traceFile = trace_open(tracePath, compile ? TRACE_SCRIPT : 0)) == NULL)
+    {
+        free(tail);
+        if (script != NULL)
         {
-            strcpy(inpCommand[i], token);
-            token = strtok(NULL, " ");
-            ++i;
+            munmap(script, st.st_size);
         }
+        return -1;
+    }
 
-        // Execute the appropriate command based on the input
-        if (strcmp(inpCommand[0], "CR") == 0)
-        {
-            // File create
-            CR(inpCommand[1], atoi(inpCommand[2]));
-        }
-        else if (strcmp(inpCommand[0], "DL") == 0)
-        {
-            // File delete
-            DL(inpCommand[1]);
-        }
-        else if (strcmp(inpCommand[0], "CP") == 0)
-        {
-            // File copy
-            CP(inpCommand[1], inpCommand[2]);
-        }
-        else if (strcmp(inpCommand[0], "MV") == 0)
+    // Initialize variables
+    char *inpCommand[3];
+    int op;
+    long long last_ns = now_ns(), begin;
+    traceRecord rec = {0};
+
+    // Initialize the file system
+    if (!compile && init_fs() == -1)
+    {
+        free(tail);
+        if (script != NULL)
         {
-            // File move
-            MV(inpCommand[1], inpCommand[2]);
+            munmap(script, st.st_size);
         }
-        else if (strcmp(inpCommand[0], "CD") == 0)
+        if (traceFile != NULL)
         {
-            // Create directory
-            CD(inpCommand[1]);
+            fclose(traceFile);
         }
-        else if (strcmp(inpCommand[0], "DD") == 0)
+        return -1;
+    }
+
+    // Read commands from the input file, then from its unterminated last line
+    for (int part = 0; part < 2; ++part)
+    {
+        while (cur < end)
         {
-            // Delete directory
-            DD(inpCommand[1]);
+            if ((op = script_line(&cur, inpCommand)) == OP_NONE)
+            {
+                continue; // Ignore unknown commands and blank lines.
+            }
+            rec.op = op;
+            rec.arg1 = inpCommand[1];
+            rec.arg2 = inpCommand[2];
+            rec.size = atoi(inpCommand[2]);
+            if (compile)
+            {
+                trace_write(traceFile, &rec); // Parsed once here, replayed with no parsing.
+                continue;
+            }
+
+            begin = now_ns();
+            rec.result = execute(op, inpCommand[1], inpCommand[2], rec.size);
+
+            // Record the command with its timing and result
+            if (traceFile != NULL)
+            {
+                rec.delta = begin - last_ns;
+                rec.latency = now_ns() - begin;
+                trace_write(traceFile, &rec);
+                last_ns = begin;
+            }
         }
-        else if (strcmp(inpCommand[0], "LL") == 0)
+        if (tail != NULL && part == 0)
         {
-            // List files and directories
-            LL("/");
+            cur = tail;
+            end = tail + tailLen;
         }
     }
 
-    // Close the input file
-    fclose(inpFile);
+    // Write what the last commit interval left pending
+    if (pendingCommits > 0)
+    {
+        sync_fs();
+        fs_unlock(); // Held since the first command of the interval.
+    }
+
+    // Report how much space sharing saved
+    if (dedup && !compile)
+    {
+        printf("dedup: %d blocks referenced, %d stored, ratio %.2f\n",
+               BLOCK_COUNT - free_blocks() + stats.sharedRefs, BLOCK_COUNT - free_blocks(), dedup_ratio());
+    }
+
+    // Unmap the input file
+    free(tail);
+    if (script != NULL)
+    {
+        munmap(script, st.st_size);
+    }
+    if (traceFile != NULL)
+    {
+        fclose(traceFile);
+    }
 
     return 0; //Return success code.
 }
@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Damages one record of an image on disk, then checks that the image no
+# longer loads, that --fsck finds the damage and that --fsck repair leaves
+# an image that loads and checks clean.
+#
+#   make fsck-test
+#
+BIN=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+printf 'CD /d\nCR /d/aaaa 1\nCR /d/bbbb 1\nCR /d/cccc 1\nCR /d/dddd 1\nCD /d/e\nCR /d/e/f 2\nCR /g 1\n' > make.txt
+printf 'LL\n' > list.txt
+failed=0
+
+# check NAME SHARDS DAMAGE: builds an image, runs DAMAGE on it, then checks and repairs it
+check()
+{
+    rm -f myfs.txt*
+    "$BIN" --shards "$2" make.txt > /dev/null
+    sh -c "$3"
+    if "$BIN" list.txt > out.txt; then
+        echo "FAIL $1: the damaged image still loads"
+        failed=1
+    elif "$BIN" --fsck > out.txt; then
+        echo "FAIL $1: --fsck found no problems"
+        failed=1
+    elif "$BIN" --fsck repair > out.txt || ! grep -q "repaired" out.txt; then
+        echo "FAIL $1: --fsck repair did not repair"
+        failed=1
+    elif ! "$BIN" --fsck > out.txt; then
+        echo "FAIL $1: problems left after the repair"
+        failed=1
+    elif ! "$BIN" list.txt > out.txt || ! grep -q "path: /d" out.txt; then
+        echo "FAIL $1: the repaired image does not load"
+        failed=1
+    else
+        echo "ok   $1"
+    fi
+}
+
+check "inode record" 1 "sed -i 's/^6 0 1 33 /6 0 1 43 /' myfs.txt"
+check "entry record" 1 "sed -i 's/^35 bbbb 6/35 bbbx 6/' myfs.txt"
+check "group record" 1 "sed -i 's/^1 0 28 f /1 0 28 ff /' myfs.txt"
+check "truncated image" 1 "head -c 300 myfs.txt > cut && mv cut myfs.txt"
+check "missing shard" 2 "rm myfs.txt.1"
+exit $failed